@@ -10,112 +10,242 @@
 #pragma once
 
 #include <algorithm>
-#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
-////////////////////////////////////////////////////////////////
-// The namespace `KNN`
-// In general, it should not be used or modified externally.
-namespace KNN {
+#include <Eigen/Core>
+
+#include "KnnBase.h"
+#include "KnnBinary.h"
+#include "KnnDynamic.h"
+#include "KnnFile.h"
+#include "KnnHalf.h"
+#include "KnnHnsw.h"
+#include "KnnIvf.h"
+#include "KnnPq.h"
+#include "KnnKdTree.h"
+#include "KnnLsh.h"
+#include "KnnMetric.h"
+#include "KnnRpForest.h"
+#include "KnnSimd.h"
+#include "KnnSq.h"
+#include "KnnThreadPool.h"
+#include "KnnVpTree.h"
 
 ////////////////////////////////////////////////////////////////
-// Data structure for KNN classifier.
-template <typename data_type, typename label_type>
-struct Data {
+// KNN classifier.
+// `metric` is the distance of the scans (see <KnnMetric.h>), fixed at compile time so that the scan
+// calls its SIMD kernel directly, e.g. `Knn<float, int, KNN::Cosine>`.
+template <typename data_type, typename label_type = int, typename metric = KNN::Euclidean>
+class Knn {
+    using KnnDataSet = KNN::DataSet<data_type>;
+    using KnnIndex = KNN::Index<data_type>;
     using stdVectorData = std::vector<data_type>;
-    stdVectorData m_data;
-    label_type m_label;
+    using stdVectorLabel = std::vector<label_type>;
+    using stdVectorClass = std::vector<unsigned int>;
+    using stdHashMap = std::unordered_map<label_type, unsigned int>;
+    using eigScalar = std::conditional_t<std::is_same<data_type, float>::value, float, double>;
+    using eigMatrix = Eigen::Matrix<eigScalar, Eigen::Dynamic, Eigen::Dynamic>;
+    using eigVector = Eigen::Matrix<eigScalar, Eigen::Dynamic, 1>;
+    using eigRowMap = Eigen::Map<const Eigen::Matrix<data_type, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>>;
+
+    static constexpr unsigned int BATCH_QUERY_BLOCK = 128;  /* Queries per block of `classifyBatch`. */
+    static constexpr unsigned int BATCH_TRAIN_BLOCK = 1024; /* Training rows per tile of `classifyBatch`. */
+    static constexpr unsigned int PARALLEL_MIN_ROWS = 65536; /* Default training rows from which a scan is split. */
+    static constexpr double COMPACT_RATIO = 0.25;            /* Default fraction of dead or unindexed rows from which to compact. */
+
+public:
+    static constexpr std::uint64_t NO_ID = ~std::uint64_t(0); /* Returned by `add` when it cannot add the row. */
+
+    Knn() : m_testData(nullptr), m_dataSet(new KnnDataSet()), m_normsReady(false), m_parallelMinRows(PARALLEL_MIN_ROWS){}; /* Constructor. */
+    ~Knn() { compactionLock(); }         /* Destructor. */
+    Knn(const Knn&) = delete;            /* Deleted the copy constructor. */
+    Knn& operator=(const Knn&) = delete; /* Deleted the copy assignment operator. */
 
     /**
-	 * Constructor.
+	 * Overloaded the operator `[]`.
+	 * Finded K-nearest-neighbor and decided the label of `m_testData`.
 	 */
-    Data(const data_type* data, const unsigned int dim, label_type label) {
-        m_data = stdVectorData(data, data + dim);
-        m_label = label;
+    label_type operator[](const unsigned int K) {
+        return query(m_testData, K);
     }
 
     /**
-	 * Calculated Euclidean distance.
+	 * Finded K-nearest-neighbor and decided the label of `test`.
+	 * Unlike `classify(test)[K]` it keeps no state in the classifier: all scratch lives on
+	 * the caller's stack, so any number of threads may query one loaded `Knn` at once.
+	 * The queries share a lock with `add`, `remove` and `init`, but only count themselves on a
+	 * cache line of their own thread, so they do not contend with each other; they wait only
+	 * while a change runs.
 	 */
-    double EuclideanDistance(const data_type* test) {
-        double result = 0;
-        for (int i = m_data.size(); i--;)
-            result += (m_data[i] - test[i]) * (m_data[i] - test[i]);
-        return std::sqrt(result);
+    label_type query(const data_type* test, unsigned int K) const {
+        auto lock = readLock();
+        return nearestLabel(test, K);
     }
-};
 
-////////////////////////////////////////////////////////////////
-// STRUCT TEMPLATE greater.
-template <typename label_type = int>
-struct KnnLabelGreater {
-    using stdPair = std::pair<double, label_type>;
-    constexpr bool operator()(const stdPair& left, const stdPair& right) const {
-        return left.first > right.first;
+    label_type query(const stdVectorData& test, unsigned int K) const {
+        return query(test.data(), K);
     }
-};
-} // namespace KNN
 
-////////////////////////////////////////////////////////////////
-// KNN classifier.
-template <typename data_type, typename label_type = int>
-class Knn {
-    using KnnComparator = KNN::KnnLabelGreater<label_type>;
-    using KnnData = KNN::Data<data_type, label_type>;
-    using stdVectorKnnData = std::vector<KnnData>;
-    using stdVectorData = std::vector<data_type>;
-    using stdVectorLabel = std::vector<label_type>;
-    using stdPair = std::pair<double, label_type>;
-    using stdVectorPair = std::vector<stdPair>;
-    using stdHashMap = std::unordered_map<label_type, int>;
+    /**
+	 * Wrote the (at most) `K` nearest live rows of `test` to `out`, from the nearest to the farthest,
+	 * as their ids (see `add`) and distances, and returned how many; the labels are not read.
+	 * The distances are those the neighbors are ranked by: `metric::rank` for the scan (e.g. the
+	 * squared distance for `Euclidean`), or those of the index (see `setIndex`).
+	 *
+	 *      KNN::Match neighbors[10];
+	 *      const unsigned int count = knn.search(test, 10, neighbors);
+	 */
+    unsigned int search(const data_type* test, unsigned int K, KNN::Match* out) const {
+        if (!test || !out)
+            return 0;
+        auto lock = readLock();
+        K = std::min(K, liveSize());
+        if (!K)
+            return 0;
+        KNN::Neighbor local[KNN::STATIC_TOPK_LIMIT];
+        std::vector<KNN::Neighbor> heap;
+        KNN::Neighbor* neighbors = local;
+        if (K > KNN::STATIC_TOPK_LIMIT) {
+            heap.resize(K);
+            neighbors = heap.data();
+        }
+        const unsigned int count = KNN::withTopK(K, [&](auto top) {
+            nearest(test, K, top);
+            return top.copyTo(neighbors);
+        });
+        for (unsigned int i = 0; i < count; ++i)
+            out[i] = KNN::Match{idOf(neighbors[i].index), neighbors[i].distance};
+        return count;
+    }
 
-public:
-    Knn() : m_testData(nullptr){};       /* Constructor. */
-    ~Knn() = default;                    /* Destructor. */
-    Knn(const Knn&) = delete;            /* Deleted the copy constructor. */
-    Knn& operator=(const Knn&) = delete; /* Deleted the copy assignment operator. */
+    unsigned int search(const stdVectorData& test, unsigned int K, std::vector<KNN::Match>& out) const {
+        out.resize(K);
+        out.resize(search(test.data(), K, out.data()));
+        return static_cast<unsigned int>(out.size());
+    }
 
     /**
-	 * Overloaded the operator `[]`.
-	 * Finded K-nearest-neighbor and decided the label of `m_testData`.
+	 * Classified `nQueries` rows of `queries` (laid out like the data of `init`) at once,
+	 * writing the label of the i-th query to `out[i]`.
+	 * Euclidean distances are computed by blocks as ||q||² - 2·q·t + ||t||², where the q·t block
+	 * is a cache-blocked matrix product and ||t||² is computed once, by the first batch after `init`.
+	 *
+	 * @note  The expansion loses some precision to cancellation compared with `operator[]`,
+	 *        so near ties may be broken differently.
+	 *        With an index (see `setIndex`), or another `metric`, the queries are answered one
+	 *        by one instead, shared out over the threads of `setThreads`.
 	 */
-    label_type operator[](const unsigned int K) {
-        if (K <= m_dataSet.size()) {
-            stdVectorPair distance;
-            for (KnnData& data : m_dataSet)
-                distance.push_back(std::make_pair(data.EuclideanDistance(m_testData), data.m_label));
-
-            std::make_heap(distance.begin(), distance.end(), m_greater);
-            if (K == 1) { // 1nn
-                return distance.front().second;
-            } else { // knn
-                stdVectorLabel result;
-                result.reserve(K);
-                for (int i = K; i--;) {
-                    std::pop_heap(distance.begin(), distance.end(), m_greater);
-                    result.push_back(distance.back().second);
-                    distance.pop_back();
-                }
-                return neighborVote(result);
-            }
+    void classifyBatch(const data_type* queries, unsigned int nQueries, unsigned int K, label_type* out) const {
+        if (!queries || !out)
+            return;
+        auto lock = readLock();
+        if (!K || K > liveSize()) {
+            std::fill(out, out + nQueries, label_type());
+            return;
         }
-        return label_type();
+        if (m_index || !KNN::isEuclidean<metric>) {
+            queryBatch(queries, nQueries, K, out);
+            return;
+        }
+        KNN::withTopK(K, [&](auto top) {
+            batch(queries, nQueries, top, out);
+        });
+    }
+
+    void classifyBatch(const stdVectorData& queries, unsigned int K, stdVectorLabel& out) const {
+        const unsigned int nQueries = m_dataSet->dim() ? static_cast<unsigned int>(queries.size() / m_dataSet->dim()) : 0;
+        out.resize(nQueries);
+        classifyBatch(queries.data(), nQueries, K, out.data());
     }
 
     /**
 	 * Input the data to be classified.
 	 */
-    Knn<data_type, label_type>& classify(const data_type* data) {
+    Knn& classify(const data_type* data) {
         this->m_testData = data;
         return *this;
     }
 
-    Knn<data_type, label_type>& classify(const stdVectorData& data) {
+    Knn& classify(const stdVectorData& data) {
         return classify(data.data());
     }
 
+    /**
+	 * Split every single-query scan over `threads` threads (the caller included) once the
+	 * training set holds at least `minRows` rows; each thread keeps the K nearest of its
+	 * partition and the partitions are merged. `threads <= 1` restores the serial scan.
+	 * Not thread-safe: call it before querying.
+	 */
+    void setThreads(unsigned int threads, unsigned int minRows = PARALLEL_MIN_ROWS) {
+        m_pool.reset(threads > 1 ? new KNN::ThreadPool(threads) : nullptr);
+        m_parallelMinRows = minRows;
+    }
+
+    /**
+	 * Answered queries with an index built over the training set, instead of scanning it:
+	 *
+	 *      knn.setIndex(KNN::KdTreeParams{});  // KD-tree, exact
+	 *      knn.setIndex(KNN::HnswParams{});    // HNSW graph, approximate
+	 *      knn.setIndex(KNN::IvfParams{});     // inverted lists, approximate
+	 *      knn.setIndex(KNN::PqParams{});      // product-quantized codes, approximate
+	 *      knn.setIndex(KNN::SqParams{});      // 8-bit scalar-quantized codes, approximate
+	 *      knn.setIndex(KNN::HalfParams{});    // fp16 / bf16 rows, scanned in float
+	 *      knn.setIndex(KNN::LshParams{});     // locality-sensitive hashing, approximate
+	 *      knn.setIndex(KNN::RpForestParams{}); // random-projection trees, approximate, mappable file
+	 *      knn.setIndex(KNN::VpTreeParams<KNN::Levenshtein>{}); // VP-tree, exact, any metric
+	 *      knn.setIndex(KNN::BinaryParams{});  // bit-packed codes, exact Hamming
+	 *      knn.setIndex(KNN::DynamicParams<KNN::KdTreeParams>{}); // KD-trees kept up to date by `add`
+	 *      knn.setIndex(KNN::BruteForce{});    // back to the scan
+	 *
+	 * The index is (re)built by every `init`, and right away when data is already loaded.
+	 * `load` reads a saved index back instead of building it.
+	 * An index keeping its own compressed copy of the rows (e.g. `PqParams`, `HalfParams`, or `SqParams` without re-ranking)
+	 * releases the training set: changing the index afterwards needs a new `init`. One keeping a
+	 * full copy in its own order (`KdTreeParams`, `IvfParams`) keeps the training set as well, so the
+	 * rows are held twice.
+	 * Every index but the VP-tree and the binary codes ranks by Euclidean distance, whatever the
+	 * `metric` of the classifier.
+	 */
+    template <typename params>
+    void setIndex(const params& p) {
+        auto lock = compactionLock();
+        m_makeIndex = [p]() -> KnnIndex* { return new typename params::template index<data_type>(p); };
+        m_index.reset(m_makeIndex());
+        if (m_dataSet->size())
+            buildIndex();
+    }
+
+    void setIndex(KNN::BruteForce) {
+        auto lock = compactionLock();
+        m_makeIndex = nullptr;
+        m_index.reset();
+    }
+
+    /**
+	 * The index in use, nullptr for the brute-force scan; e.g. to tune a built index:
+	 *
+	 *      static_cast<KNN::Hnsw<float>*>(knn.index())->setEfSearch(128);
+	 *
+	 * A compaction (see `remove`) replaces it with a new one, made from the parameters of `setIndex`.
+	 */
+    KnnIndex* index() {
+        return m_index.get();
+    }
+
     /**
 	 * Loading all data.
 	 *
@@ -130,10 +260,11 @@ public:
 	 */
     void init(const data_type* data, unsigned int dim, const label_type* label, unsigned int size) {
         if (data && dim && label && size) {
-            m_dataSet.clear();
-            m_dataSet.reserve(size);
-            for (unsigned int i = 0, idx = 0; i < size; ++i, idx += dim)
-                m_dataSet.push_back(KnnData(data + idx, dim, label[i]));
+            auto lock = compactionLock();
+            m_dataSet->assign(data, dim, size);
+            intern(label, size);
+            m_file.reset();
+            loaded();
         }
     }
 
@@ -141,32 +272,744 @@ public:
         init(data.data(), dim, label.data(), size);
     }
 
+    /**
+	 * Took over `data` instead of copying it, for a caller that no longer needs it: the training
+	 * set is never held twice.
+	 *
+	 *      knn.init(std::move(data), dim, labels, size);
+	 *
+	 * @note  `data.size() >= dim * size`, `label.size() >= size`
+	 */
+    void init(stdVectorData&& data, unsigned int dim, const stdVectorLabel& label, unsigned int size) {
+        if (dim && size && data.size() >= static_cast<std::size_t>(dim) * size && label.size() >= size) {
+            auto lock = compactionLock();
+            m_dataSet->adopt(std::move(data), dim, size);
+            intern(label.data(), size);
+            m_file.reset();
+            loaded();
+        }
+    }
+
+    /**
+	 * Pointed the classifier at the caller's rows instead of copying them; only the labels are read.
+	 *
+	 * @note  Lifetime: `data` must stay valid and unchanged until the next `init`, `initView` or
+	 *        `initFromFile`, or the destruction of the classifier. An index that keeps its own copy
+	 *        of the rows (see `setIndex`) drops the reference once built.
+	 */
+    void initView(const data_type* data, unsigned int dim, const label_type* label, unsigned int size) {
+        if (data && dim && label && size) {
+            auto lock = compactionLock();
+            m_dataSet->view(data, dim, size);
+            intern(label, size);
+            m_file.reset();
+            loaded();
+        }
+    }
+
+    /**
+	 * Loaded a training set file written by `KNN::writeDataFile`, mapping it instead of copying
+	 * its rows: they are scanned in place, so a large model loads in milliseconds and all the
+	 * processes of a host loading the same file share its pages. The kernel is told to read
+	 * ahead for the scan (or not to, for an index jumping around in the rows).
+	 * Returned false, keeping the current data, when the file is missing or does not hold
+	 * `data_type` rows and `label_type` labels.
+	 *
+	 *      KNN::writeDataFile("model.knn", data, dim, labels, size);
+	 *      knn.initFromFile("model.knn");
+	 */
+    bool initFromFile(const std::string& path) {
+        static_assert(std::is_trivially_copyable<label_type>::value, "a training set file holds labels of a trivially copyable type");
+        std::unique_ptr<KNN::MappedFile> file(new KNN::MappedFile());
+        if (!file->open(path))
+            return false;
+        const KNN::DataFileHeader* header = KNN::readDataFile<data_type, label_type>(*file);
+        if (!header)
+            return false;
+
+        auto lock = compactionLock();
+        const std::size_t rowsBytes = static_cast<std::size_t>(header->dim) * header->size * sizeof(data_type);
+        file->advise(header->dataBegin, rowsBytes, m_index ? KNN::MappedFile::Access::Random : KNN::MappedFile::Access::Sequential);
+        m_dataSet->view(reinterpret_cast<const data_type*>(file->data() + header->dataBegin), header->dim, header->size);
+        const label_type* labels = reinterpret_cast<const label_type*>(file->data() + header->labelBegin);
+        intern(labels, header->size);
+        m_file = std::move(file);
+        loaded();
+        return true;
+    }
+
+    /**
+	 * Saved the classifier to `path`: the training set, and the built index with its parameters,
+	 * so that `load` does not build it again. Returned whether it worked.
+	 *
+	 *      knn.setIndex(KNN::HnswParams{});
+	 *      knn.init(data, dim, labels, size);
+	 *      knn.save("model.knnm");
+	 *      ...
+	 *      other.setIndex(KNN::HnswParams{});
+	 *      other.load("model.knnm");
+	 */
+    bool save(const std::string& path) const {
+        static_assert(std::is_trivially_copyable<label_type>::value, "a model file holds labels of a trivially copyable type");
+        auto lock = readLock();
+        if (m_classOf.empty())
+            return false;
+        KNN::ModelFileHeader header{};
+        std::memcpy(header.magic, KNN::ModelFileHeader::MAGIC, sizeof(header.magic));
+        header.version = KNN::ModelFileHeader::VERSION;
+        header.endian = KNN::ModelFileHeader::ENDIAN;
+        header.dataType = KNN::DataFileHeader::typeTag<data_type>();
+        header.labelType = KNN::DataFileHeader::typeTag<label_type>();
+        header.dim = m_dataSet->dim();
+        header.size = static_cast<std::uint32_t>(m_classOf.size());
+        header.hasRows = m_dataSet->size() != 0;
+        header.hasIndex = m_index != nullptr;
+        header.indexed = m_index ? m_indexed : 0;
+        header.nextId = m_nextId;
+        return KNN::writeFile(path, [&](std::FILE* file) {
+            KNN::ArchiveWriter out(file);
+            out.value(header);
+            out.array(m_dataSet->row(0), header.hasRows ? static_cast<std::size_t>(header.dim) * header.size : 0);
+            out.vector(m_classes);
+            out.vector(m_classOf);
+            out.vector(m_ids);
+            out.vector(m_removed);
+            if (m_index)
+                m_index->save(out);
+            return out.ok();
+        });
+    }
+
+    /**
+	 * Loaded a model file written by `save`, mapping it: the rows are scanned in place as by
+	 * `initFromFile`, and the index set with `setIndex` is read back instead of built when the
+	 * file holds one of its kind, else built over the rows.
+	 * Returned false, keeping the current data, when the file is missing, of another version or
+	 * byte order, or does not hold `data_type` rows and `label_type` labels, or when it holds no
+	 * rows (its index kept its own copy) and no index of the kind set, or when its ids or tombstones
+	 * are inconsistent. A file whose index turns out to be corrupt after all leaves the classifier empty.
+	 */
+    bool load(const std::string& path) {
+        static_assert(std::is_trivially_copyable<label_type>::value, "a model file holds labels of a trivially copyable type");
+        std::shared_ptr<KNN::MappedFile> file(new KNN::MappedFile());
+        if (!file->open(path))
+            return false;
+        KNN::ArchiveReader in(file->data(), file->size(), file);
+        KNN::ModelFileHeader header;
+        const data_type* rows = nullptr;
+        const label_type* classes = nullptr;
+        const std::uint64_t* ids = nullptr;
+        const std::uint8_t* removed = nullptr;
+        const unsigned int* classOf = nullptr;
+        std::size_t rowCount = 0, classCount = 0, classOfCount = 0, idCount = 0, removedCount = 0;
+        if (!in.value(header) || !header.valid<data_type, label_type>() || !in.array(rows, rowCount) || !in.array(classes, classCount) ||
+            !in.array(classOf, classOfCount) || !in.array(ids, idCount) || !in.array(removed, removedCount) ||
+            rowCount != (header.hasRows ? static_cast<std::size_t>(header.dim) * header.size : 0) || classOfCount != header.size ||
+            std::any_of(classOf, classOf + classOfCount, [&](unsigned int c) { return c >= classCount; }) ||
+            (idCount && idCount != header.size) || (removedCount && removedCount != header.size) || header.indexed > header.size ||
+            (!header.hasRows && !(m_index && header.hasIndex && header.indexed == header.size)) ||
+            !validIds(ids, idCount, header.size, header.nextId) ||
+            std::any_of(removed, removed + removedCount, [](std::uint8_t dead) { return dead > 1; }))
+            return false;
+
+        auto lock = compactionLock();
+        if (header.hasRows) {
+            file->advise(reinterpret_cast<const char*>(rows) - file->data(), rowCount * sizeof(data_type),
+                         m_index ? KNN::MappedFile::Access::Random : KNN::MappedFile::Access::Sequential);
+            m_dataSet->view(rows, header.dim, header.size);
+        } else {
+            m_dataSet->view(nullptr, header.dim, 0);
+        }
+        m_classes.assign(classes, classes + classCount);
+        m_classOf.assign(classOf, classOf + classOfCount);
+        m_classIds.clear();
+        for (unsigned int c = 0; c < m_classes.size(); ++c)
+            m_classIds.emplace(m_classes[c], c);
+        m_file = std::move(file);
+        eigVector().swap(m_norms);
+        m_normsReady = false;
+        m_ids.assign(ids, ids + idCount);
+        m_removed.assign(removed, removed + removedCount);
+        m_removedCount = static_cast<unsigned int>(std::count(m_removed.begin(), m_removed.end(), std::uint8_t(1)));
+        m_nextId = header.nextId;
+        m_indexed = header.size;
+        if (!m_index)
+            return true;
+        if (header.hasIndex && m_index->load(in, *m_dataSet)) {
+            m_indexed = header.indexed;
+            if (!m_index->needsData()) {
+                m_dataSet->release();
+                m_file.reset();
+            }
+            return true;
+        }
+        if (header.hasRows) {
+            buildIndex();
+            return true;
+        }
+        m_dataSet->release();
+        m_classes.clear();
+        m_classOf.clear();
+        m_classIds.clear();
+        m_ids.clear();
+        m_removed.clear();
+        m_removedCount = 0;
+        m_file.reset();
+        return false;
+    }
+
+    /**
+	 * Added the row `sample`, of the `dim` of `init`, labelled `label`, and returned its id, or `NO_ID`
+	 * before the first `init` or when an index released the training set (see `setIndex`).
+	 * The rows of `init` have the ids 0 to size - 1, and every added row the next one; an id never
+	 * changes, nor is it given twice. The row is appended without copying the others (a mapped or
+	 * viewed training set is copied once, by the first `add`); an index that can take rows one by one
+	 * (HNSW, LSH) takes it, else the queries scan it until the next compaction rebuilds the index.
+	 * May run while other threads query.
+	 *
+	 *      const std::uint64_t id = knn.add(sample, label);
+	 *      ...
+	 *      knn.remove(id);
+	 */
+    std::uint64_t add(const data_type* sample, const label_type& label) {
+        auto lock = writeLock();
+        if (!sample || !m_dataSet->dim() || m_dataSet->size() != m_classOf.size())
+            return NO_ID;
+        const unsigned int row = m_dataSet->size();
+        m_dataSet->append(sample);
+        m_classOf.push_back(intern(label));
+        m_file.reset();
+        if (!m_ids.empty() || m_nextId != row) {
+            // the rows so far may have their row as id while the new one has not (e.g. all were removed).
+            if (m_ids.empty()) {
+                m_ids.resize(row);
+                std::iota(m_ids.begin(), m_ids.end(), std::uint64_t(0));
+            }
+            m_ids.push_back(m_nextId);
+        }
+        if (!m_removed.empty())
+            m_removed.push_back(0);
+        if (m_normsReady) {
+            m_norms.conservativeResize(row + 1);
+            m_norms[row] = trainMap(row, 1).squaredNorm();
+        }
+        if (m_index && m_indexed == row && m_index->insert(*m_dataSet, row))
+            ++m_indexed;
+        startCompaction();
+        return m_nextId++;
+    }
+
+    std::uint64_t add(const stdVectorData& sample, const label_type& label) {
+        return add(sample.data(), label);
+    }
+
+    /**
+	 * Removed the row of id `id`, and returned whether there was one. The row is only marked dead,
+	 * and skipped by the queries; once dead rows make up the ratio of `setCompaction`, a background
+	 * thread copies the live ones and rebuilds the index over them, then swaps them in.
+	 * May run while other threads query.
+	 */
+    bool remove(std::uint64_t id) {
+        auto lock = writeLock();
+        const unsigned int row = rowOf(id);
+        if (row == m_classOf.size() || isRemoved(row))
+            return false;
+        if (m_removed.empty())
+            m_removed.assign(m_classOf.size(), 0);
+        m_removed[row] = 1;
+        ++m_removedCount;
+        startCompaction();
+        return true;
+    }
+
+    /**
+	 * Compacted the training set now, in the calling thread (e.g. before `save`): dropped the dead
+	 * rows and rebuilt the index over all the live ones.
+	 */
+    void compact() {
+        {
+            auto lock = compactionLock();
+            m_compacting = true;
+        }
+        compactRows();
+        endCompaction();
+    }
+
+    /**
+	 * Started a background compaction whenever the dead rows, or those an index does not hold,
+	 * reach `ratio` of the training set; 0 compacts only on `compact()`.
+	 */
+    void setCompaction(double ratio) {
+        auto lock = writeLock();
+        m_compactRatio = ratio;
+    }
+
+    /**
+	 * Live rows of the training set.
+	 */
+    unsigned int size() const {
+        auto lock = readLock();
+        return liveSize();
+    }
+
 private:
     /**
-	 * Voted for result by finding the majority labels.
-	 */
-    label_type neighborVote(stdVectorLabel& labels) {
-        stdHashMap voter;
-        label_type label;
-        int count = 0;
-        for (auto& res : labels) {
-            auto got = voter.find(res);
-            if (got == voter.end())
-                voter.insert(std::make_pair(res, 1));
-            else
-                (got->second)++;
-        }
-        for (auto& v : voter) {
-            if (v.second > count) {
-                count = v.second;
-                label = v.first;
+	 * Whether the `count` ids of a model file of `size` rows are strictly ascending (as `rowOf`
+	 * searches them) and below `nextId`; without ids, the rows are 0 to size - 1.
+	 */
+    static bool validIds(const std::uint64_t* ids, std::size_t count, unsigned int size, std::uint64_t nextId) {
+        if (!count)
+            return nextId >= size;
+        for (std::size_t i = 1; i < count; ++i)
+            if (ids[i - 1] >= ids[i])
+                return false;
+        return ids[count - 1] < nextId;
+    }
+
+    /**
+	 * Reset what depends on the training set after it changed, and built the index.
+	 */
+    void loaded() {
+        eigVector().swap(m_norms);
+        m_normsReady = false;
+        std::vector<std::uint64_t>().swap(m_ids);
+        std::vector<std::uint8_t>().swap(m_removed);
+        m_removedCount = 0;
+        m_nextId = m_classOf.size();
+        if (m_index)
+            buildIndex();
+    }
+
+    /**
+	 * `query`, with the lock held.
+	 */
+    label_type nearestLabel(const data_type* test, unsigned int K) const {
+        if (test && K && K <= liveSize()) {
+            return KNN::withTopK(K, [&](auto top) {
+                nearest(test, K, top);
+                return neighborVote(top.data(), top.size());
+            });
+        }
+        return label_type();
+    }
+
+    /**
+	 * The K nearest live rows of `test`, into `top`: through `m_index`, or by the scan.
+	 */
+    template <typename selector>
+    void nearest(const data_type* test, unsigned int K, selector& top) const {
+        if (m_index)
+            indexSearch(test, K, top);
+        else if (m_pool && m_dataSet->size() >= m_parallelMinRows)
+            parallelScan(test, top);
+        else
+            scan(test, top, 0, m_dataSet->size());
+    }
+
+    unsigned int liveSize() const {
+        return static_cast<unsigned int>(m_classOf.size()) - m_removedCount;
+    }
+
+    bool isRemoved(unsigned int row) const {
+        return m_removedCount && m_removed[row];
+    }
+
+    /**
+	 * Row of id `id`, or the number of rows if there is none. The ids grow with the rows.
+	 */
+    unsigned int rowOf(std::uint64_t id) const {
+        const unsigned int size = static_cast<unsigned int>(m_classOf.size());
+        if (m_ids.empty())
+            return id < size ? static_cast<unsigned int>(id) : size;
+        const auto found = std::lower_bound(m_ids.begin(), m_ids.end(), id);
+        return found != m_ids.end() && *found == id ? static_cast<unsigned int>(found - m_ids.begin()) : size;
+    }
+
+    std::uint64_t idOf(unsigned int row) const {
+        return m_ids.empty() ? row : m_ids[row];
+    }
+
+    /**
+	 * ||t||² of every training row, computed on first use, so that loading a mapped training set
+	 * does not read it all.
+	 */
+    const eigVector& norms() const {
+        std::lock_guard<std::mutex> lock(m_normsLock);
+        if (!m_normsReady) {
+            m_norms = trainMap(0, m_dataSet->size()).rowwise().squaredNorm();
+            m_normsReady = true;
+        }
+        return m_norms;
+    }
+
+    /**
+	 * Compared rows [`first`, `last`) with `test` by `metric`, keeping the nearest ones in `top`.
+	 */
+    template <typename selector>
+    void scan(const data_type* test, selector& top, unsigned int first, unsigned int last) const {
+        const unsigned int dim = m_dataSet->dim();
+        const auto distance = metric::template rank<data_type>();
+        if (m_removedCount) {
+            for (unsigned int i = first; i < last; ++i)
+                if (!m_removed[i])
+                    top.push(distance(m_dataSet->row(i), test, dim), i);
+            return;
+        }
+        for (unsigned int i = first; i < last; ++i)
+            top.push(distance(m_dataSet->row(i), test, dim), i);
+    }
+
+    /**
+	 * `scan` of the whole training set split in one partition per pool thread, then merged into `top`.
+	 */
+    template <typename selector>
+    void parallelScan(const data_type* test, selector& top) const {
+        const unsigned int size = m_dataSet->size();
+        const unsigned int parts = m_pool->size();
+        std::vector<selector> tops(parts, top);
+        m_pool->run(parts, [&](unsigned int part) {
+            const unsigned int first = static_cast<unsigned int>(static_cast<std::size_t>(size) * part / parts);
+            const unsigned int last = static_cast<unsigned int>(static_cast<std::size_t>(size) * (part + 1) / parts);
+            scan(test, tops[part], first, last);
+        });
+        for (const selector& local : tops)
+            for (unsigned int i = 0; i < local.size(); ++i)
+                top.push(local.data()[i].distance, local.data()[i].index);
+    }
+
+    /**
+	 * Built `m_index` over the training set, then released the rows if it no longer reads them.
+	 */
+    void buildIndex() {
+        m_index->build(*m_dataSet);
+        m_indexed = m_dataSet->size();
+        if (!m_index->needsData()) {
+            m_dataSet->release();
+            m_file.reset();
+        }
+    }
+
+    /**
+	 * The K nearest live rows through `m_index`, into `top`: asked the index for twice as many
+	 * rows until K of those it returns are not dead, then scanned the rows added since it was built.
+	 */
+    template <typename selector>
+    void indexSearch(const data_type* test, unsigned int K, selector& top) const {
+        KNN::Neighbor local[KNN::STATIC_TOPK_LIMIT];
+        std::vector<KNN::Neighbor> heap;
+        for (unsigned int fetch = K;; fetch = std::min(2 * fetch, m_indexed)) {
+            KNN::Neighbor* neighbors = local;
+            if (fetch > KNN::STATIC_TOPK_LIMIT) {
+                heap.resize(fetch);
+                neighbors = heap.data();
+            }
+            const unsigned int count = m_index->search(test, fetch, neighbors);
+            unsigned int live = 0;
+            for (unsigned int i = 0; i < count; ++i)
+                live += !isRemoved(neighbors[i].index);
+            if (live >= K || count < fetch || fetch >= m_indexed) {
+                for (unsigned int i = 0; i < count; ++i)
+                    if (!isRemoved(neighbors[i].index))
+                        top.push(neighbors[i].distance, neighbors[i].index);
+                break;
+            }
+        }
+
+        const unsigned int dim = m_dataSet->dim();
+        for (unsigned int i = m_indexed; i < m_dataSet->size(); ++i)
+            if (!isRemoved(i))
+                top.push(m_index->distance(m_dataSet->row(i), test, dim), i);
+    }
+
+    /**
+	 * `classifyBatch` one `query` at a time, the queries shared out over the pool if there is one.
+	 */
+    void queryBatch(const data_type* queries, unsigned int nQueries, unsigned int K, label_type* out) const {
+        const std::size_t dim = m_dataSet->dim();
+        if (!m_pool) {
+            for (unsigned int i = 0; i < nQueries; ++i)
+                out[i] = nearestLabel(queries + i * dim, K);
+            return;
+        }
+        const unsigned int parts = m_pool->size();
+        m_pool->run(parts, [&](unsigned int part) {
+            const unsigned int first = static_cast<unsigned int>(static_cast<std::size_t>(nQueries) * part / parts);
+            const unsigned int last = static_cast<unsigned int>(static_cast<std::size_t>(nQueries) * (part + 1) / parts);
+            for (unsigned int i = first; i < last; ++i)
+                out[i] = nearestLabel(queries + i * dim, K);
+        });
+    }
+
+    /**
+	 * Rows [`first`, `first + rows`) of the training set as an Eigen matrix of `eigScalar`.
+	 */
+    auto trainMap(unsigned int first, unsigned int rows) const {
+        const eigRowMap map(m_dataSet->row(first), rows, m_dataSet->dim());
+        if constexpr (std::is_same<data_type, eigScalar>::value)
+            return map;
+        else
+            return map.template cast<eigScalar>();
+    }
+
+    /**
+	 * `classifyBatch` with the selection type of `prototype`.
+	 * Queries go by blocks of BATCH_QUERY_BLOCK; each block meets the training set by tiles
+	 * of BATCH_TRAIN_BLOCK rows, so the product tile stays in cache while it is selected from.
+	 */
+    template <typename selector>
+    void batch(const data_type* queries, unsigned int nQueries, const selector& prototype, label_type* out) const {
+        const unsigned int size = m_dataSet->size();
+        const unsigned int dim = m_dataSet->dim();
+        const eigVector& trainNorms = norms();
+        std::vector<selector> tops;
+        eigMatrix products;
+
+        for (unsigned int q0 = 0; q0 < nQueries; q0 += BATCH_QUERY_BLOCK) {
+            const unsigned int qRows = std::min(BATCH_QUERY_BLOCK, nQueries - q0);
+            const eigMatrix block = eigRowMap(queries + static_cast<std::size_t>(q0) * dim, qRows, dim).template cast<eigScalar>();
+            const eigVector blockNorms = block.rowwise().squaredNorm();
+            tops.assign(qRows, prototype);
+
+            for (unsigned int t0 = 0; t0 < size; t0 += BATCH_TRAIN_BLOCK) {
+                const unsigned int tRows = std::min(BATCH_TRAIN_BLOCK, size - t0);
+                // column `i` holds q_i·t for the whole tile, contiguous.
+                products.noalias() = trainMap(t0, tRows) * block.transpose();
+                for (unsigned int i = 0; i < qRows; ++i) {
+                    const eigScalar* column = products.col(i).data();
+                    const eigScalar* norms = trainNorms.data() + t0;
+                    selector& top = tops[i];
+                    for (unsigned int j = 0; j < tRows; ++j) {
+                        if (isRemoved(t0 + j))
+                            continue;
+                        const double distance = static_cast<double>(blockNorms[i]) + norms[j] - 2 * static_cast<double>(column[j]);
+                        top.push(distance > 0 ? distance : 0, t0 + j);
+                    }
+                }
+            }
+
+            for (unsigned int i = 0; i < qRows; ++i)
+                out[q0 + i] = neighborVote(tops[i].data(), tops[i].size());
+        }
+    }
+
+    /**
+	 * Started a background compaction if the dead rows, or those `m_index` does not hold, reached
+	 * the ratio of `setCompaction`, and none is running. Called with the lock held.
+	 */
+    void startCompaction() {
+        const double size = static_cast<double>(m_classOf.size());
+        const unsigned int unindexed = m_makeIndex ? m_dataSet->size() - m_indexed : 0;
+        if (m_compactRatio <= 0 || m_dataSet->size() != m_classOf.size() || m_compacting ||
+            (m_removedCount < m_compactRatio * size && unindexed < m_compactRatio * size))
+            return;
+        if (m_compactor.joinable())
+            m_compactor.join(); // finished: it cleared `m_compacting` as it returned.
+        m_compacting = true;
+        m_compactor = std::thread([this]() {
+            compactRows();
+            endCompaction();
+        });
+    }
+
+    /**
+	 * Cleared `m_compacting` under the lock, and woke those waiting for it.
+	 */
+    void endCompaction() {
+        {
+            auto lock = writeLock();
+            m_compacting = false;
+        }
+        m_compactionEnded.notify_all();
+    }
+
+    /**
+	 * Shared lock of the queries: they only count themselves on a slot of their thread, and hold
+	 * back while a change waits for the lock, so a steady stream of them cannot starve `add` and `remove`.
+	 */
+    std::shared_lock<KNN::ReadMostlyMutex> readLock() const {
+        return std::shared_lock<KNN::ReadMostlyMutex>(m_lock);
+    }
+
+    std::unique_lock<KNN::ReadMostlyMutex> writeLock() {
+        return std::unique_lock<KNN::ReadMostlyMutex>(m_lock);
+    }
+
+    /**
+	 * Exclusive lock, taken once no compaction runs (none can start before it is released), with
+	 * the thread of the last background one joined.
+	 */
+    std::unique_lock<KNN::ReadMostlyMutex> compactionLock() {
+        auto lock = writeLock();
+        m_compactionEnded.wait(lock, [this]() { return !m_compacting; });
+        if (m_compactor.joinable())
+            m_compactor.join(); // finished: it has only to return.
+        return lock;
+    }
+
+    /**
+	 * Copied the live rows (under a shared lock, so that queries go on), built a new index over
+	 * them (unlocked), then swapped them in under the lock, along with the rows added and the
+	 * tombstones set meanwhile.
+	 */
+    void compactRows() {
+        std::unique_ptr<KnnDataSet> rows(new KnnDataSet());
+        stdVectorClass classOf;
+        std::vector<std::uint64_t> ids;
+        std::vector<std::uint8_t> dead; /* Rows dead when the copy was made. */
+        std::function<KnnIndex*()> makeIndex;
+        unsigned int snapshot = 0;
+        {
+            auto lock = readLock();
+            snapshot = m_dataSet->size();
+            if (!snapshot || snapshot != m_classOf.size())
+                return; // nothing to compact, or an index released the rows.
+            const unsigned int dim = m_dataSet->dim();
+            stdVectorData data;
+            data.reserve(static_cast<std::size_t>(liveSize()) * dim);
+            classOf.reserve(liveSize());
+            ids.reserve(liveSize());
+            dead.assign(snapshot, 0);
+            for (unsigned int i = 0; i < snapshot; ++i) {
+                if (isRemoved(i)) {
+                    dead[i] = 1;
+                    continue;
+                }
+                data.insert(data.end(), m_dataSet->row(i), m_dataSet->row(i) + dim);
+                classOf.push_back(m_classOf[i]);
+                ids.push_back(idOf(i));
+            }
+            rows->adopt(std::move(data), dim, static_cast<unsigned int>(classOf.size()));
+            makeIndex = m_makeIndex;
+        }
+
+        // no live row is left to build over: the rows added meanwhile wait for the next compaction.
+        std::unique_ptr<KnnIndex> index(makeIndex && rows->size() ? makeIndex() : nullptr);
+        if (index)
+            index->build(*rows);
+        unsigned int indexed = rows->size();
+
+        auto lock = writeLock();
+        std::vector<std::uint8_t> removed(rows->size(), 0);
+        unsigned int removedCount = 0;
+        for (unsigned int i = 0, row = 0; i < snapshot; ++i) {
+            if (dead[i])
+                continue;
+            if (isRemoved(i)) {
+                removed[row] = 1;
+                ++removedCount;
+            }
+            ++row;
+        }
+        for (unsigned int i = snapshot; i < m_dataSet->size(); ++i) {
+            const unsigned int row = rows->size();
+            rows->append(m_dataSet->row(i));
+            classOf.push_back(m_classOf[i]);
+            ids.push_back(idOf(i));
+            removed.push_back(isRemoved(i));
+            removedCount += isRemoved(i);
+            if (index && indexed == row && index->insert(*rows, row))
+                ++indexed;
+        }
+
+        m_dataSet = std::move(rows);
+        m_classOf.swap(classOf);
+        // ascending distinct ids, as many as were ever given, are 0 to size - 1 again (and
+        // the next one is size, as `add` takes for granted while there are none).
+        if (ids.size() == m_nextId)
+            ids.clear();
+        m_ids.swap(ids);
+        if (!removedCount)
+            removed.clear();
+        m_removed.swap(removed);
+        m_removedCount = removedCount;
+        m_index = std::move(index);
+        m_indexed = indexed;
+        m_file.reset();
+        eigVector().swap(m_norms);
+        m_normsReady = false;
+    }
+
+    /**
+	 * Class id of `label`, given the next one if it is new.
+	 */
+    unsigned int intern(const label_type& label) {
+        auto got = m_classIds.find(label);
+        if (got != m_classIds.end())
+            return got->second;
+        const unsigned int id = static_cast<unsigned int>(m_classes.size());
+        m_classIds.emplace(label, id);
+        m_classes.push_back(label);
+        return id;
+    }
+
+    /**
+	 * Replaced the labels by the `size` ones of `label`.
+	 */
+    void intern(const label_type* label, unsigned int size) {
+        m_classes.clear();
+        m_classIds.clear();
+        m_classOf.resize(size);
+        for (unsigned int i = 0; i < size; ++i)
+            m_classOf[i] = intern(label[i]);
+    }
+
+    /**
+	 * Voted for result by finding the majority class among the neighbors' class ids, sorted so
+	 * that every class is a run; a tie goes to the class seen first in the training set. Only
+	 * the winner is turned back into its label.
+	 */
+    label_type neighborVote(const KNN::Neighbor* neighbors, unsigned int count) const {
+        if (count == 0)
+            return label_type();
+        if (count == 1) // 1nn
+            return m_classes[m_classOf[neighbors[0].index]];
+
+        unsigned int local[KNN::STATIC_TOPK_LIMIT];
+        stdVectorClass heap;
+        unsigned int* votes = local;
+        if (count > KNN::STATIC_TOPK_LIMIT) {
+            heap.resize(count);
+            votes = heap.data();
+        }
+        for (unsigned int i = 0; i < count; ++i)
+            votes[i] = m_classOf[neighbors[i].index];
+        std::sort(votes, votes + count);
+
+        unsigned int best = votes[0], bestRun = 0;
+        for (unsigned int i = 0, run = 1; i < count; ++i, ++run) {
+            if (i + 1 < count && votes[i + 1] == votes[i])
+                continue;
+            if (run > bestRun) {
+                best = votes[i];
+                bestRun = run;
             }
+            run = 0;
         }
-        return label;
+        return m_classes[best];
     }
 
 private:
     const data_type* m_testData;
-    stdVectorKnnData m_dataSet;
-    KnnComparator m_greater;
+    std::unique_ptr<KnnDataSet> m_dataSet; /* Behind a pointer, so that an index built over it stays valid when a compaction swaps it. */
+    stdVectorLabel m_classes; /* The distinct labels, by class id. */
+    stdVectorClass m_classOf; /* Class id of every row. */
+    stdHashMap m_classIds;    /* Class id of every distinct label. */
+    std::shared_ptr<KNN::MappedFile> m_file; /* The mapped file of `initFromFile` or `load`, if any; an index loaded from it may share it. */
+    mutable std::mutex m_normsLock;
+    mutable eigVector m_norms; /* ||t||² of every training row, for `classifyBatch`. */
+    mutable bool m_normsReady;
+    std::unique_ptr<KNN::ThreadPool> m_pool;
+    unsigned int m_parallelMinRows;
+    std::unique_ptr<KnnIndex> m_index;
+    std::function<KnnIndex*()> m_makeIndex; /* A new index of the kind of `setIndex`, for the compactions. */
+    unsigned int m_indexed = 0;             /* Rows `m_index` holds, the first ones; the later ones are scanned. */
+    std::vector<std::uint64_t> m_ids;       /* Id of every row, ascending; empty while they are 0 to size - 1. */
+    std::vector<std::uint8_t> m_removed;    /* Tombstone of every row; empty while none is set. */
+    unsigned int m_removedCount = 0;
+    std::uint64_t m_nextId = 0;
+    double m_compactRatio = COMPACT_RATIO;
+    mutable KNN::ReadMostlyMutex m_lock; /* Shared by the queries, exclusive to the changes of the training set. */
+    std::thread m_compactor; /* The last background compaction; it and `m_compacting` change under `m_lock`. */
+    bool m_compacting = false; /* Whether a compaction (in the background, or of `compact`) runs. */
+    std::condition_variable_any m_compactionEnded;
 };
@@ -0,0 +1,169 @@
+//
+// KnnArchive.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnArchive.h> header.
+// Binary archives of <Knn.h> and its indexes: plain values and arrays written in the byte order of the
+// machine, every array 64-byte aligned from the start of the archive, so that a mapped archive is read
+// back by copying arrays out of it, or by pointing into it.
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+class MappedFile;
+
+////////////////////////////////////////////////////////////////
+// Writes an archive to a file, sequentially; a failed write makes `ok()` false.
+class ArchiveWriter {
+public:
+    static constexpr std::size_t ALIGNMENT = 64; /* Of every array, from the start of the archive. */
+    static constexpr std::size_t TAG = 16;       /* Bytes of a tag. */
+
+    explicit ArchiveWriter(std::FILE* file) : m_file(file) {}
+
+    template <typename T>
+    void value(const T& v) {
+        static_assert(std::is_trivially_copyable<T>::value, "archived values are trivially copyable");
+        write(&v, sizeof(T));
+    }
+
+    /**
+	 * `count`, then the `count` elements of `data`, aligned.
+	 */
+    template <typename T>
+    void array(const T* data, std::size_t count) {
+        static_assert(std::is_trivially_copyable<T>::value, "archived arrays are trivially copyable");
+        value(static_cast<std::uint64_t>(count));
+        static const char zeros[ALIGNMENT] = {};
+        write(zeros, (ALIGNMENT - m_offset % ALIGNMENT) % ALIGNMENT);
+        write(data, count * sizeof(T));
+    }
+
+    template <typename T, typename allocator>
+    void vector(const std::vector<T, allocator>& v) {
+        array(v.data(), v.size());
+    }
+
+    /**
+	 * A name of up to TAG - 1 characters, checked back by `ArchiveReader::tag`.
+	 */
+    void tag(const char* name) {
+        char bytes[TAG] = {};
+        std::strncpy(bytes, name, TAG - 1);
+        write(bytes, TAG);
+    }
+
+    bool ok() const { return m_ok; }
+
+private:
+    void write(const void* data, std::size_t size) {
+        if (size && m_ok)
+            m_ok = std::fwrite(data, 1, size, m_file) == size;
+        m_offset += size;
+    }
+
+    std::FILE* m_file;
+    std::uint64_t m_offset = 0;
+    bool m_ok = true;
+};
+
+////////////////////////////////////////////////////////////////
+// Reads an archive from memory (e.g. a mapped file). Every read checks the bounds; once one fails,
+// all the following ones fail too and `ok()` is false.
+class ArchiveReader {
+public:
+    /**
+	 * Constructor, `file` is the mapped file `data` lies in, if it does (see `file()`).
+	 */
+    ArchiveReader(const char* data, std::size_t size, std::shared_ptr<const MappedFile> file = nullptr)
+        : m_data(data), m_size(size), m_file(std::move(file)) {}
+
+    template <typename T>
+    bool value(T& v) {
+        static_assert(std::is_trivially_copyable<T>::value, "archived values are trivially copyable");
+        if (!take(sizeof(T)))
+            return false;
+        std::memcpy(&v, m_data + m_offset - sizeof(T), sizeof(T));
+        return true;
+    }
+
+    /**
+	 * Pointed `data` at the `count` elements of the next array, in place.
+	 */
+    template <typename T>
+    bool array(const T*& data, std::size_t& count) {
+        std::uint64_t n = 0;
+        if (!value(n) || !take((ArchiveWriter::ALIGNMENT - m_offset % ArchiveWriter::ALIGNMENT) % ArchiveWriter::ALIGNMENT))
+            return false;
+        if (n > (m_size - m_offset) / sizeof(T))
+            return m_ok = false;
+        data = reinterpret_cast<const T*>(m_data + m_offset);
+        count = static_cast<std::size_t>(n);
+        m_offset += count * sizeof(T);
+        return true;
+    }
+
+    /**
+	 * Copied the next array into `v`.
+	 */
+    template <typename T, typename allocator>
+    bool vector(std::vector<T, allocator>& v) {
+        const T* data = nullptr;
+        std::size_t count = 0;
+        if (!array(data, count))
+            return false;
+        v.resize(count);
+        if (count)
+            std::memcpy(v.data(), data, count * sizeof(T));
+        return true;
+    }
+
+    /**
+	 * Read a tag, and returned whether it is `name`.
+	 */
+    bool tag(const char* name) {
+        char expected[ArchiveWriter::TAG] = {};
+        std::strncpy(expected, name, ArchiveWriter::TAG - 1);
+        if (!take(ArchiveWriter::TAG))
+            return false;
+        if (std::memcmp(m_data + m_offset - ArchiveWriter::TAG, expected, ArchiveWriter::TAG) != 0)
+            return m_ok = false;
+        return true;
+    }
+
+    bool ok() const { return m_ok; }
+
+    /**
+	 * The mapped file the archive lies in, if any: an index that shares it may keep pointing at
+	 * the arrays it read in place instead of copying them out.
+	 */
+    const std::shared_ptr<const MappedFile>& file() const { return m_file; }
+
+private:
+    bool take(std::size_t size) {
+        if (!m_ok || size > m_size - m_offset)
+            return m_ok = false;
+        m_offset += size;
+        return true;
+    }
+
+    const char* m_data;
+    std::size_t m_size;
+    std::size_t m_offset = 0;
+    bool m_ok = true;
+    std::shared_ptr<const MappedFile> m_file;
+};
+} // namespace KNN
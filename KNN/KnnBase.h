@@ -0,0 +1,473 @@
+//
+// KnnBase.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnBase.h> header.
+// Building blocks shared by <Knn.h> and its indexes: the training set storage,
+// the bounded K-nearest selections and the index interface.
+//
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "KnnArchive.h"
+#include "KnnSimd.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+////////////////////////////////////////////////////////////////
+// Allocator handing out `alignment`-byte aligned storage, so that a row-major
+// training set starts on a cache line (and on a SIMD register boundary).
+template <typename T, std::size_t alignment = 64>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, alignment>;
+    };
+
+    AlignedAllocator() noexcept = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, alignment>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignment)));
+    }
+
+    void deallocate(T* p, std::size_t) noexcept {
+        ::operator delete(p, std::align_val_t(alignment));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, alignment>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, alignment>&) const noexcept { return false; }
+};
+
+////////////////////////////////////////////////////////////////
+// Training set for KNN classifier.
+// All samples live in one contiguous row-major buffer (`dim` values per row);
+// the labels are kept apart by the classifier so that a scan only streams the sample values.
+// The buffer is either owned (`assign`, `adopt`) or memory the set only points to (`view`), e.g. a
+// mapped file.
+template <typename data_type>
+struct DataSet {
+    using stdVectorData = std::vector<data_type, AlignedAllocator<data_type>>;
+    stdVectorData m_data;
+    std::vector<data_type> m_adopted;  /* The caller's vector, taken over by `adopt`. */
+    const data_type* m_rows = nullptr; /* `m_data`, `m_adopted`, or the viewed memory. */
+    unsigned int m_dim = 0;
+    unsigned int m_size = 0;
+
+    DataSet() = default;
+    DataSet(DataSet&&) = default;
+    DataSet& operator=(DataSet&&) = default;
+    DataSet(const DataSet& other) { *this = other; }
+
+    /**
+	 * A copy of an owning set owns its own copy of the rows; a copy of a view is a view.
+	 */
+    DataSet& operator=(const DataSet& other) {
+        if (this != &other) {
+            m_data = other.m_data;
+            m_adopted = other.m_adopted;
+            if (other.m_rows == other.m_data.data())
+                m_rows = m_data.data();
+            else if (other.m_rows == other.m_adopted.data())
+                m_rows = m_adopted.data();
+            else
+                m_rows = other.m_rows;
+            m_dim = other.m_dim;
+            m_size = other.m_size;
+        }
+        return *this;
+    }
+
+    /**
+	 * Bulk copy of `size` rows of `dim` values.
+	 */
+    void assign(const data_type* data, unsigned int dim, unsigned int size) {
+        m_data.assign(data, data + static_cast<std::size_t>(dim) * size);
+        std::vector<data_type>().swap(m_adopted);
+        m_rows = m_data.data();
+        m_dim = dim;
+        m_size = size;
+    }
+
+    /**
+	 * Pointed at `size` rows of `dim` values owned by someone else, without copying them;
+	 * they must outlive the set (or its next `assign` / `view` / `release`).
+	 */
+    void view(const data_type* data, unsigned int dim, unsigned int size) {
+        stdVectorData().swap(m_data);
+        std::vector<data_type>().swap(m_adopted);
+        m_rows = data;
+        m_dim = dim;
+        m_size = size;
+    }
+
+    /**
+	 * Took over the buffer of `data` (`size` rows of `dim` values, any values past them dropped so
+	 * that `append` writes right after the rows) without copying it.
+	 * Its rows are only as aligned as `std::vector` makes them, which the kernels accept.
+	 */
+    void adopt(std::vector<data_type>&& data, unsigned int dim, unsigned int size) {
+        stdVectorData().swap(m_data);
+        m_adopted = std::move(data);
+        m_adopted.resize(static_cast<std::size_t>(dim) * size);
+        m_rows = m_adopted.data();
+        m_dim = dim;
+        m_size = size;
+    }
+
+    /**
+	 * Appended one row of `dim` values. A viewed set first copies the rows it points to, once;
+	 * the buffer grows geometrically, so appending is amortized O(dim).
+	 */
+    void append(const data_type* row) {
+        if (!m_adopted.empty() && m_rows == m_adopted.data()) {
+            m_adopted.insert(m_adopted.end(), row, row + m_dim);
+            m_rows = m_adopted.data();
+        } else {
+            if (m_rows != m_data.data())
+                m_data.assign(m_rows, m_rows + static_cast<std::size_t>(m_size) * m_dim);
+            m_data.insert(m_data.end(), row, row + m_dim);
+            m_rows = m_data.data();
+        }
+        ++m_size;
+    }
+
+    /**
+	 * Freed the rows, once an index that keeps its own copy no longer reads them.
+	 */
+    void release() {
+        stdVectorData().swap(m_data);
+        std::vector<data_type>().swap(m_adopted);
+        m_rows = nullptr;
+        m_size = 0;
+    }
+
+    /**
+	 * Pointer to the first value of row `i`.
+	 */
+    const data_type* row(unsigned int i) const {
+        return m_rows + static_cast<std::size_t>(i) * m_dim;
+    }
+
+    unsigned int size() const { return m_size; }
+    unsigned int dim() const { return m_dim; }
+};
+
+////////////////////////////////////////////////////////////////
+// Calculated Euclidean distance between two rows of `dim` values.
+template <typename data_type>
+double EuclideanDistance(const data_type* data, const data_type* test, unsigned int dim) {
+    return std::sqrt(simd::squaredL2<data_type>()(data, test, dim));
+}
+
+////////////////////////////////////////////////////////////////
+// A candidate neighbor: its squared distance and its row in the training set.
+struct Neighbor {
+    double distance;
+    unsigned int index;
+};
+
+////////////////////////////////////////////////////////////////
+// A neighbor as `Knn::search` reports it: the id of its row (see `Knn::add`) and its distance.
+struct Match {
+    std::uint64_t id;
+    double distance;
+};
+
+////////////////////////////////////////////////////////////////
+// Bounded selection of the `K` nearest candidates, for any `K`.
+// A max-heap of at most `K` entries whose top is the current worst candidate,
+// so a scan costs O(K) memory and rejects most rows with one comparison.
+class TopK {
+public:
+    explicit TopK(unsigned int K) : m_k(K) {
+        m_heap.reserve(K);
+    }
+
+    /**
+	 * Distance a candidate has to beat to enter the selection.
+	 */
+    double threshold() const {
+        return m_heap.size() < m_k ? std::numeric_limits<double>::infinity() : m_heap.front().distance;
+    }
+
+    void push(double distance, unsigned int index) {
+        if (m_heap.size() < m_k) {
+            m_heap.push_back(Neighbor{distance, index});
+            std::push_heap(m_heap.begin(), m_heap.end(), less);
+        } else if (distance < m_heap.front().distance) {
+            std::pop_heap(m_heap.begin(), m_heap.end(), less);
+            m_heap.back() = Neighbor{distance, index};
+            std::push_heap(m_heap.begin(), m_heap.end(), less);
+        }
+    }
+
+    /**
+	 * Selected candidates, in no particular order.
+	 */
+    const Neighbor* data() const { return m_heap.data(); }
+    unsigned int size() const { return static_cast<unsigned int>(m_heap.size()); }
+
+    /**
+	 * Wrote the selected candidates to `out` from the nearest to the farthest, returned how many.
+	 * The selection is left sorted, it can not take candidates anymore.
+	 */
+    unsigned int copyTo(Neighbor* out) {
+        std::sort_heap(m_heap.begin(), m_heap.end(), less);
+        std::copy(m_heap.begin(), m_heap.end(), out);
+        return size();
+    }
+
+private:
+    static bool less(const Neighbor& left, const Neighbor& right) {
+        return left.distance < right.distance;
+    }
+
+    std::vector<Neighbor> m_heap;
+    unsigned int m_k;
+};
+
+////////////////////////////////////////////////////////////////
+// Bounded selection of the `K` nearest candidates, for a compile-time `K`.
+// The candidates stay sorted; a new one enters at the last slot and sinks through
+// a fixed chain of `K - 1` branch-free compare-exchanges (an insertion network).
+template <unsigned int K>
+class StaticTopK {
+public:
+    StaticTopK() {
+        for (Neighbor& item : m_items)
+            item = Neighbor{std::numeric_limits<double>::infinity(), 0};
+    }
+
+    double threshold() const { return m_items[K - 1].distance; }
+
+    void push(double distance, unsigned int index) {
+        if (distance < m_items[K - 1].distance) {
+            m_items[K - 1] = Neighbor{distance, index};
+            for (unsigned int i = K - 1; i > 0; --i)
+                compareExchange(m_items[i - 1], m_items[i]);
+            m_size += m_size < K;
+        }
+    }
+
+    const Neighbor* data() const { return m_items; }
+    unsigned int size() const { return m_size; }
+
+    unsigned int copyTo(Neighbor* out) const {
+        std::copy(m_items, m_items + m_size, out);
+        return m_size;
+    }
+
+private:
+    static void compareExchange(Neighbor& a, Neighbor& b) {
+        const bool swap = b.distance < a.distance;
+        const Neighbor low = swap ? b : a;
+        const Neighbor high = swap ? a : b;
+        a = low;
+        b = high;
+    }
+
+    Neighbor m_items[K];
+    unsigned int m_size = 0;
+};
+
+////////////////////////////////////////////////////////////////
+// Bounded selection of the `K` nearest candidates whose distances are small integers in
+// [0, `maxDistance`] (e.g. Hamming distances). Candidates are counted per distance and the
+// threshold drops to the smallest distance already reached by `K` of them, so a push is a
+// compare and an increment instead of a heap update.
+class CountingTopK {
+public:
+    CountingTopK(unsigned int K, unsigned int maxDistance) : m_k(K), m_threshold(maxDistance), m_counts(maxDistance + 1, 0) {}
+
+    /**
+	 * Largest distance a candidate may have to enter the selection.
+	 */
+    unsigned int threshold() const { return m_threshold; }
+
+    /**
+	 * A candidate at the threshold is dropped once `K` are held at or below it: it could only tie
+	 * with them, and many ties (duplicate codes) would otherwise pile up without bound.
+	 */
+    void push(unsigned int distance, unsigned int index) {
+        if (distance > m_threshold || (distance == m_threshold && m_accepted >= m_k))
+            return;
+        m_candidates.push_back(Neighbor{static_cast<double>(distance), index});
+        ++m_counts[distance];
+        if (++m_accepted - m_counts[m_threshold] < m_k)
+            return;
+        while (m_threshold > 0 && m_accepted - m_counts[m_threshold] >= m_k) {
+            m_accepted -= m_counts[m_threshold];
+            --m_threshold;
+        }
+        if (m_candidates.size() >= 4 * static_cast<std::size_t>(m_k) + 64)
+            compact();
+    }
+
+    /**
+	 * Wrote the (at most) `K` nearest candidates to `out`, ascending, and returned how many.
+	 */
+    unsigned int copyTo(Neighbor* out) {
+        compact();
+        const unsigned int count = std::min(m_k, static_cast<unsigned int>(m_candidates.size()));
+        std::partial_sort(m_candidates.begin(), m_candidates.begin() + count, m_candidates.end(), [](const Neighbor& a, const Neighbor& b) {
+            return a.distance < b.distance || (a.distance == b.distance && a.index < b.index);
+        });
+        std::copy(m_candidates.begin(), m_candidates.begin() + count, out);
+        return count;
+    }
+
+private:
+    /**
+	 * Dropped the candidates left above the threshold.
+	 */
+    void compact() {
+        const double threshold = m_threshold;
+        m_candidates.erase(std::remove_if(m_candidates.begin(), m_candidates.end(), [&](const Neighbor& item) { return item.distance > threshold; }),
+                           m_candidates.end());
+    }
+
+    unsigned int m_k;
+    unsigned int m_threshold;
+    unsigned int m_accepted = 0; /* Candidates at or below the threshold. */
+    std::vector<unsigned int> m_counts;
+    std::vector<Neighbor> m_candidates;
+};
+
+/**
+ * `K` up to which the compile-time selection is used.
+ */
+constexpr unsigned int STATIC_TOPK_LIMIT = 8;
+
+/**
+ * Called `f` with an empty selection of `K` candidates, `StaticTopK<K>` when `K` is small
+ * and `TopK` otherwise. `f` takes the selection by value: `[&](auto top) { ... }`.
+ */
+template <typename function>
+decltype(auto) withTopK(unsigned int K, function&& f) {
+    switch (K) {
+    case 1: return f(StaticTopK<1>());
+    case 2: return f(StaticTopK<2>());
+    case 3: return f(StaticTopK<3>());
+    case 4: return f(StaticTopK<4>());
+    case 5: return f(StaticTopK<5>());
+    case 6: return f(StaticTopK<6>());
+    case 7: return f(StaticTopK<7>());
+    case 8: return f(StaticTopK<8>());
+    default: return f(TopK(K));
+    }
+}
+
+////////////////////////////////////////////////////////////////
+// Epoch-tagged visited set, reused by all the searches of a thread.
+class VisitedSet {
+public:
+    /**
+	 * Started a new search over `size` nodes, forgetting the previous one in O(1).
+	 */
+    void reset(std::size_t size) {
+        if (m_marks.size() < size)
+            m_marks.resize(size, 0);
+        if (++m_epoch == 0) {
+            std::fill(m_marks.begin(), m_marks.end(), 0);
+            m_epoch = 1;
+        }
+    }
+
+    /**
+	 * Marked `node`, returned false if it was already.
+	 */
+    bool visit(unsigned int node) {
+        if (m_marks[node] == m_epoch)
+            return false;
+        m_marks[node] = m_epoch;
+        return true;
+    }
+
+    static VisitedSet& local() {
+        thread_local VisitedSet visited;
+        return visited;
+    }
+
+private:
+    std::vector<unsigned int> m_marks;
+    unsigned int m_epoch = 0;
+};
+
+////////////////////////////////////////////////////////////////
+// Search structure built over a training set, answering the K-nearest queries of <Knn.h>
+// in place of the brute-force scan. Selected by `Knn::setIndex(params)`, where `params`
+// (e.g. `KdTreeParams`) names its index type as `params::index<data_type>`.
+template <typename data_type>
+class Index {
+public:
+    virtual ~Index() = default;
+
+    /**
+	 * Built over `data`. The training set belongs to the classifier and outlives the index.
+	 */
+    virtual void build(const DataSet<data_type>& data) = 0;
+
+    /**
+	 * Wrote the (at most) `K` nearest rows of `test` to `out`, from the nearest to the farthest,
+	 * and returned how many. Distances are squared Euclidean distances, unless the index has
+	 * a metric of its own (e.g. <KnnVpTree.h>).
+	 */
+    virtual unsigned int search(const data_type* test, unsigned int K, Neighbor* out) const = 0;
+
+    /**
+	 * Whether `search` still reads the training set; if not, the classifier frees it after `build`.
+	 */
+    virtual bool needsData() const { return true; }
+
+    /**
+	 * Added row `row`, appended to `data` (the set of `build`) since, and returned whether it did.
+	 * The classifier scans the rows an index does not take, until it rebuilds the index.
+	 */
+    virtual bool insert(const DataSet<data_type>& data, unsigned int row) {
+        (void)data;
+        (void)row;
+        return false;
+    }
+
+    /**
+	 * Distance between two rows, as `search` reports it.
+	 */
+    virtual double distance(const data_type* a, const data_type* b, unsigned int dim) const {
+        return simd::squaredL2<data_type>()(a, b, dim);
+    }
+
+    /**
+	 * Wrote the built structure (and its parameters) to `out`; the training set is saved apart.
+	 */
+    virtual void save(ArchiveWriter& out) const = 0;
+
+    /**
+	 * Restored a structure written by `save` over `data`, the training set it was built over
+	 * (empty if the index did not need it), in place of `build`. Returned false if `in` does
+	 * not hold an index of this type.
+	 */
+    virtual bool load(ArchiveReader& in, const DataSet<data_type>& data) = 0;
+};
+
+////////////////////////////////////////////////////////////////
+// Parameters of the default brute-force scan (no index).
+struct BruteForce {};
+} // namespace KNN
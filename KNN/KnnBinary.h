@@ -0,0 +1,260 @@
+//
+// KnnBinary.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnBinary.h> header.
+// Binary code index for <Knn.h>: every row is packed into a code of 64-bit words (one bit per value, or the
+// bytes of the row as they are), and queries scan the codes by Hamming distance, popcount(a ^ b), with the
+// hardware popcount and, where present, AVX-512 VPOPCNTDQ. Hamming distances being small integers, the K
+// nearest are selected by counting (`CountingTopK`). The index keeps only the codes: 1 bit per value.
+//
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "KnnBase.h"
+#include "KnnSimd.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+template <typename data_type>
+class Binary;
+
+////////////////////////////////////////////////////////////////
+// Parameters of the binary code index.
+struct BinaryParams {
+    bool packed = false; /* Whether the rows already hold the bits (their bytes are the code), else every nonzero value is a 1 bit. */
+
+    template <typename data_type>
+    using index = Binary<data_type>;
+};
+
+////////////////////////////////////////////////////////////////
+// Hamming scans of `count` codes of `words` words against `query`.
+namespace binary {
+
+using Scan = void (*)(const std::uint64_t* codes, unsigned int count, const std::uint64_t* query, unsigned int words, CountingTopK& top);
+
+inline unsigned int popcount(std::uint64_t value) {
+    value = value - ((value >> 1) & 0x5555555555555555ull);
+    value = (value & 0x3333333333333333ull) + ((value >> 2) & 0x3333333333333333ull);
+    value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return static_cast<unsigned int>((value * 0x0101010101010101ull) >> 56);
+}
+
+/**
+ * Scalar reference, for `W` words (0 for `words`).
+ */
+template <unsigned int W>
+void scanScalar(const std::uint64_t* codes, unsigned int count, const std::uint64_t* query, unsigned int words, CountingTopK& top) {
+    const unsigned int n = W ? W : words;
+    for (unsigned int i = 0; i < count; ++i) {
+        const std::uint64_t* code = codes + static_cast<std::size_t>(i) * n;
+        unsigned int distance = 0;
+        for (unsigned int w = 0; w < n; ++w)
+            distance += popcount(code[w] ^ query[w]);
+        top.push(distance, i);
+    }
+}
+
+#ifdef KNN_SIMD_X86
+
+// GCC 12 reports its own AVX-512 intrinsics as reading uninitialized values (GCC bug 105593).
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+/**
+ * POPCNT, for `W` words (0 for `words`): fixed widths unroll completely.
+ */
+template <unsigned int W>
+KNN_TARGET("popcnt")
+void scanPopcnt(const std::uint64_t* codes, unsigned int count, const std::uint64_t* query, unsigned int words, CountingTopK& top) {
+    const unsigned int n = W ? W : words;
+    for (unsigned int i = 0; i < count; ++i) {
+        const std::uint64_t* code = codes + static_cast<std::size_t>(i) * n;
+        unsigned int distance = 0;
+        for (unsigned int w = 0; w < n; ++w)
+            distance += static_cast<unsigned int>(_mm_popcnt_u64(code[w] ^ query[w]));
+        top.push(distance, i);
+    }
+}
+
+/**
+ * VPOPCNTDQ for 64-bit codes: eight rows per register, and only the rows within the
+ * threshold are pushed.
+ */
+KNN_TARGET("popcnt,avx512f,avx512vpopcntdq")
+inline void scanVpopcnt64(const std::uint64_t* codes, unsigned int count, const std::uint64_t* query, unsigned int, CountingTopK& top) {
+    const __m512i q = _mm512_set1_epi64(static_cast<long long>(query[0]));
+    alignas(64) std::uint64_t distances[8];
+    unsigned int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m512i d = _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512(codes + i), q));
+        const __mmask8 within = _mm512_cmple_epu64_mask(d, _mm512_set1_epi64(top.threshold()));
+        if (!within)
+            continue;
+        _mm512_store_si512(distances, d);
+        for (unsigned int j = 0; j < 8; ++j)
+            if ((within >> j) & 1)
+                top.push(static_cast<unsigned int>(distances[j]), i + j);
+    }
+    for (; i < count; ++i)
+        top.push(static_cast<unsigned int>(_mm_popcnt_u64(codes[i] ^ query[0])), i);
+}
+
+/**
+ * VPOPCNTDQ for codes of 512 bits and more: eight words per register.
+ */
+KNN_TARGET("popcnt,avx512f,avx512vpopcntdq")
+inline void scanVpopcntWide(const std::uint64_t* codes, unsigned int count, const std::uint64_t* query, unsigned int words, CountingTopK& top) {
+    for (unsigned int i = 0; i < count; ++i) {
+        const std::uint64_t* code = codes + static_cast<std::size_t>(i) * words;
+        __m512i acc = _mm512_setzero_si512();
+        for (unsigned int w = 0; w < words; w += 8) {
+            const __mmask8 mask = words - w >= 8 ? __mmask8(0xff) : __mmask8((1u << (words - w)) - 1);
+            const __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi64(mask, code + w), _mm512_maskz_loadu_epi64(mask, query + w));
+            acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+        }
+        top.push(static_cast<unsigned int>(_mm512_reduce_add_epi64(acc)), i);
+    }
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // KNN_SIMD_X86
+
+/**
+ * Fastest scan for `words` at the active level of <KnnSimd.h>.
+ */
+inline Scan select(unsigned int words) {
+#ifdef KNN_SIMD_X86
+    const simd::CpuFeatures& cpu = simd::cpu();
+    const simd::Level level = simd::activeLevel();
+    if (level == simd::Level::AVX512 && cpu.avx512vpopcntdq && cpu.popcnt) {
+        if (words == 1)
+            return &scanVpopcnt64;
+        if (words >= 8)
+            return &scanVpopcntWide;
+    }
+    if (level != simd::Level::Scalar && cpu.popcnt) {
+        switch (words) {
+        case 1: return &scanPopcnt<1>;
+        case 2: return &scanPopcnt<2>;
+        case 4: return &scanPopcnt<4>;
+        case 8: return &scanPopcnt<8>;
+        default: return &scanPopcnt<0>;
+        }
+    }
+#endif
+    switch (words) {
+    case 1: return &scanScalar<1>;
+    case 2: return &scanScalar<2>;
+    case 4: return &scanScalar<4>;
+    case 8: return &scanScalar<8>;
+    default: return &scanScalar<0>;
+    }
+}
+} // namespace binary
+
+////////////////////////////////////////////////////////////////
+// Binary code index. The distances it reports are Hamming distances.
+template <typename data_type>
+class Binary : public Index<data_type> {
+    using stdVectorCode = std::vector<std::uint64_t, AlignedAllocator<std::uint64_t>>;
+
+public:
+    explicit Binary(const BinaryParams& params = BinaryParams()) : m_params(params) {}
+
+    /**
+	 * Packed every row into `words` 64-bit words, the last one padded with zero bits.
+	 */
+    void build(const DataSet<data_type>& data) override {
+        m_dim = data.dim();
+        m_size = data.size();
+        m_words = codeWords();
+        m_codes.assign(static_cast<std::size_t>(m_size) * m_words, 0);
+        for (unsigned int i = 0; i < m_size; ++i)
+            pack(data.row(i), m_codes.data() + static_cast<std::size_t>(i) * m_words);
+    }
+
+    unsigned int search(const data_type* test, unsigned int K, Neighbor* out) const override {
+        if (m_size == 0)
+            return 0;
+        std::vector<std::uint64_t> query(m_words, 0);
+        pack(test, query.data());
+        CountingTopK top(K, m_words * 64);
+        binary::select(m_words)(m_codes.data(), m_size, query.data(), m_words, top);
+        return top.copyTo(out);
+    }
+
+    /**
+	 * Only the codes are read.
+	 */
+    bool needsData() const override {
+        return false;
+    }
+
+    /**
+	 * 64-bit words per code.
+	 */
+    unsigned int words() const {
+        return m_words;
+    }
+
+    void save(ArchiveWriter& out) const override {
+        out.tag("Binary");
+        out.value(m_params);
+        out.value(m_dim);
+        out.value(m_size);
+        out.value(m_words);
+        out.vector(m_codes);
+    }
+
+    /**
+	 * The words per code are checked against the dimension, as `pack` fills a query of `words`.
+	 * The parameters are read as the byte of `packed`, which may not hold a valid `bool`.
+	 */
+    bool load(ArchiveReader& in, const DataSet<data_type>& data) override {
+        static_assert(sizeof(BinaryParams) == 1, "the parameters are archived as the byte of `packed`");
+        std::uint8_t packed = 0;
+        if (!(in.tag("Binary") && in.value(packed) && in.value(m_dim) && in.value(m_size) && in.value(m_words) && in.vector(m_codes)) || packed > 1)
+            return false;
+        m_params.packed = packed != 0;
+        return m_dim == data.dim() && m_words == codeWords() && m_codes.size() == static_cast<std::size_t>(m_size) * m_words;
+    }
+
+private:
+    unsigned int codeWords() const {
+        const std::size_t bits = m_params.packed ? static_cast<std::size_t>(m_dim) * sizeof(data_type) * 8 : m_dim;
+        return static_cast<unsigned int>((bits + 63) / 64);
+    }
+
+    void pack(const data_type* row, std::uint64_t* code) const {
+        if (m_params.packed) {
+            std::memcpy(code, row, static_cast<std::size_t>(m_dim) * sizeof(data_type));
+            return;
+        }
+        for (unsigned int d = 0; d < m_dim; ++d)
+            code[d / 64] |= static_cast<std::uint64_t>(row[d] != data_type()) << (d % 64);
+    }
+
+    BinaryParams m_params;
+    unsigned int m_dim = 0;
+    unsigned int m_size = 0;
+    unsigned int m_words = 0;
+    stdVectorCode m_codes; /* `words` words per row. */
+};
+} // namespace KNN
@@ -0,0 +1,272 @@
+//
+// KnnDynamic.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnDynamic.h> header.
+// Dynamic index for <Knn.h> over a static one (e.g. <KnnKdTree.h>), by the logarithmic method of Bentley and
+// Saxe: the rows added since the last merge wait in a small write buffer, scanned by brute force, and the others
+// are split into a few immutable sub-indexes over consecutive rows, each at least twice as large as the next newer
+// one. A full buffer is merged with the newer sub-indexes it outgrows into one new sub-index, built in the
+// background; a row is so rebuilt O(log N) times, and a query asks O(log N) sub-indexes, merging their K nearest.
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "KnnBase.h"
+#include "KnnKdTree.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+template <typename data_type, typename inner_params>
+class Dynamic;
+
+////////////////////////////////////////////////////////////////
+// Parameters of the dynamic index over the static index of `inner_params`.
+template <typename inner_params = KdTreeParams>
+struct DynamicParams {
+    inner_params inner = inner_params(); /* Parameters of every sub-index (without a `path`, for <KnnRpForest.h>). */
+    unsigned int bufferSize = 1024;      /* Rows from which the write buffer is merged into a sub-index. */
+
+    template <typename data_type>
+    using index = Dynamic<data_type, inner_params>;
+};
+
+////////////////////////////////////////////////////////////////
+// Dynamic index. The distances it reports are those of the sub-indexes.
+template <typename data_type, typename inner_params>
+class Dynamic : public Index<data_type> {
+    using InnerIndex = typename inner_params::template index<data_type>;
+
+    ////////////////////////////////////////////////////////////////
+    // Sub-index over the rows [first, first + count) of the training set. Its set views them, or holds
+    // a copy of them while it is built in the background.
+    struct Level {
+        unsigned int first = 0;
+        unsigned int count = 0;
+        DataSet<data_type> rows;
+        std::unique_ptr<InnerIndex> index;
+    };
+
+public:
+    explicit Dynamic(const DynamicParams<inner_params>& params = DynamicParams<inner_params>())
+        : m_params(params), m_metric(new InnerIndex(params.inner)) {
+        m_params.bufferSize = std::max(1u, m_params.bufferSize);
+    }
+
+    ~Dynamic() override {
+        if (m_merger.joinable())
+            m_merger.join();
+    }
+
+    /**
+	 * Built one sub-index over all the rows.
+	 */
+    void build(const DataSet<data_type>& data) override {
+        dropMerge();
+        bind(data);
+        m_size = data.size();
+        m_levels.clear();
+        if (m_size)
+            m_levels.push_back(buildLevel(0, m_size));
+        m_bufferBegin = m_size;
+    }
+
+    /**
+	 * Took the row into the write buffer; a full buffer starts a merge, and a finished merge
+	 * replaces the sub-indexes it was made of.
+	 */
+    bool insert(const DataSet<data_type>& data, unsigned int row) override {
+        if (&data != m_data || row != m_size)
+            return false;
+        ++m_size;
+        if (data.row(0) != m_base)
+            bind(data);
+
+        if (m_merger.joinable()) {
+            // the buffer outgrew a merge that is taking too long: wait for it.
+            if (m_merged || m_size - m_bufferBegin >= MAX_BUFFERS * m_params.bufferSize)
+                installMerge();
+        }
+        if (!m_merger.joinable() && m_size - m_bufferBegin >= m_params.bufferSize)
+            startMerge();
+        return true;
+    }
+
+    unsigned int search(const data_type* test, unsigned int K, Neighbor* out) const override {
+        if (m_size == 0)
+            return 0;
+        Neighbor local[STATIC_TOPK_LIMIT];
+        std::vector<Neighbor> heap;
+        Neighbor* found = local;
+        if (K > STATIC_TOPK_LIMIT) {
+            heap.resize(K);
+            found = heap.data();
+        }
+        return withTopK(K, [&](auto top) {
+            for (const std::unique_ptr<Level>& level : m_levels) {
+                const unsigned int count = level->index->search(test, K, found);
+                for (unsigned int i = 0; i < count; ++i)
+                    top.push(found[i].distance, level->first + found[i].index);
+            }
+            for (unsigned int i = m_bufferBegin; i < m_size; ++i)
+                top.push(m_metric->distance(m_data->row(i), test, m_dim), i);
+            return top.copyTo(out);
+        });
+    }
+
+    double distance(const data_type* a, const data_type* b, unsigned int dim) const override {
+        return m_metric->distance(a, b, dim);
+    }
+
+    /**
+	 * A merge in progress is not saved: its rows are saved in the sub-indexes and the buffer
+	 * it was started from.
+	 */
+    void save(ArchiveWriter& out) const override {
+        out.tag("Dynamic");
+        out.value(m_params.bufferSize);
+        out.value(m_dim);
+        out.value(m_size);
+        out.value(m_bufferBegin);
+        out.value(static_cast<std::uint32_t>(m_levels.size()));
+        for (const std::unique_ptr<Level>& level : m_levels) {
+            out.value(level->first);
+            out.value(level->count);
+            level->index->save(out);
+        }
+    }
+
+    bool load(ArchiveReader& in, const DataSet<data_type>& data) override {
+        dropMerge();
+        m_levels.clear();
+        std::uint32_t levels = 0;
+        if (!(in.tag("Dynamic") && in.value(m_params.bufferSize) && in.value(m_dim) && in.value(m_size) && in.value(m_bufferBegin) &&
+              in.value(levels)) ||
+            m_dim != data.dim() || m_size > data.size() || m_bufferBegin > m_size)
+            return false;
+        bind(data);
+        for (std::uint32_t l = 0; l < levels; ++l) {
+            std::unique_ptr<Level> level(new Level());
+            if (!(in.value(level->first) && in.value(level->count)) || level->count > m_bufferBegin || level->first > m_bufferBegin - level->count)
+                return false;
+            level->rows.view(data.row(level->first), m_dim, level->count);
+            level->index.reset(new InnerIndex(m_params.inner));
+            if (!level->index->load(in, level->rows))
+                return false;
+            if (!level->index->needsData())
+                level->rows.release();
+            m_levels.push_back(std::move(level));
+        }
+        return true;
+    }
+
+    /**
+	 * Sub-indexes, from the newest (smallest) to the oldest.
+	 */
+    unsigned int levels() const {
+        return static_cast<unsigned int>(m_levels.size());
+    }
+
+private:
+    static constexpr unsigned int MAX_BUFFERS = 4; /* Buffer sizes up to which the buffer grows while a merge runs. */
+
+    /**
+	 * Pointed at the training set `data`, and the sets of the sub-indexes at their rows in it
+	 * (which move when the training set grows).
+	 */
+    void bind(const DataSet<data_type>& data) {
+        m_data = &data;
+        m_dim = data.dim();
+        m_base = data.row(0);
+        for (const std::unique_ptr<Level>& level : m_levels)
+            if (level->index->needsData())
+                level->rows.view(data.row(level->first), m_dim, level->count);
+    }
+
+    std::unique_ptr<Level> buildLevel(unsigned int first, unsigned int count) const {
+        std::unique_ptr<Level> level(new Level());
+        level->first = first;
+        level->count = count;
+        level->rows.view(m_data->row(first), m_dim, count);
+        level->index.reset(new InnerIndex(m_params.inner));
+        level->index->build(level->rows);
+        if (!level->index->needsData())
+            level->rows.release();
+        return level;
+    }
+
+    /**
+	 * Merged the buffer and the newer sub-indexes no larger than the rows gathered so far into
+	 * one, built from a copy of its rows on a thread of its own.
+	 */
+    void startMerge() {
+        unsigned int count = m_size - m_bufferBegin;
+        unsigned int consumed = 0;
+        while (consumed < m_levels.size() && m_levels[consumed]->count <= count)
+            count += m_levels[consumed++]->count;
+
+        m_merge.reset(new Level());
+        m_merge->first = m_size - count;
+        m_merge->count = count;
+        m_merge->rows.assign(m_data->row(m_merge->first), m_dim, count);
+        m_merge->index.reset(new InnerIndex(m_params.inner));
+        m_mergeConsumed = consumed;
+        m_mergeEnd = m_size;
+        m_merged = false;
+        Level* level = m_merge.get();
+        m_merger = std::thread([this, level]() {
+            level->index->build(level->rows);
+            m_merged = true;
+        });
+    }
+
+    /**
+	 * Waited for the merge, then put its sub-index in place of those it was made of; its set
+	 * drops its copy for a view of the training set.
+	 */
+    void installMerge() {
+        m_merger.join();
+        m_levels.erase(m_levels.begin(), m_levels.begin() + m_mergeConsumed);
+        if (m_merge->index->needsData())
+            m_merge->rows.view(m_data->row(m_merge->first), m_dim, m_merge->count);
+        else
+            m_merge->rows.release();
+        m_levels.insert(m_levels.begin(), std::move(m_merge));
+        m_bufferBegin = m_mergeEnd;
+    }
+
+    /**
+	 * Waited for the merge and threw it away.
+	 */
+    void dropMerge() {
+        if (m_merger.joinable())
+            m_merger.join();
+        m_merge.reset();
+    }
+
+    DynamicParams<inner_params> m_params;
+    std::unique_ptr<InnerIndex> m_metric; /* For `distance`. */
+    const DataSet<data_type>* m_data = nullptr;
+    const data_type* m_base = nullptr; /* First row of the training set when last bound. */
+    unsigned int m_dim = 0;
+    unsigned int m_size = 0;
+    unsigned int m_bufferBegin = 0;             /* The rows from it on wait in the write buffer. */
+    std::vector<std::unique_ptr<Level>> m_levels; /* Newest first: level i holds the rows just before level i - 1. */
+    std::unique_ptr<Level> m_merge;             /* The merge in progress, if any. */
+    unsigned int m_mergeConsumed = 0;           /* Newest levels the merge replaces. */
+    unsigned int m_mergeEnd = 0;                /* End of the buffer rows the merge holds. */
+    std::thread m_merger;
+    std::atomic<bool> m_merged{false};
+};
+} // namespace KNN
@@ -0,0 +1,280 @@
+//
+// KnnFile.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnFile.h> header.
+// Read-only memory-mapped files for <Knn.h>: an index or a training set saved as one flat file is used
+// in place, so processes mapping the same file share its pages instead of each loading a copy.
+//
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(_WIN32)
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+////////////////////////////////////////////////////////////////
+// Read-only mapping of a whole file. Without `mmap` (Windows) the file is read into memory instead.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /**
+	 * Mapped the file `path`, and returned whether it worked.
+	 */
+    bool open(const std::string& path) {
+        close();
+#if defined(_WIN32)
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+            return false;
+        m_buffer.resize(static_cast<std::size_t>(file.tellg()));
+        file.seekg(0);
+        if (!file.read(m_buffer.data(), static_cast<std::streamsize>(m_buffer.size())))
+            return false;
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+        return true;
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat status;
+        if (::fstat(fd, &status) != 0 || status.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        void* address = ::mmap(nullptr, static_cast<std::size_t>(status.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED)
+            return false;
+        m_data = static_cast<const char*>(address);
+        m_size = static_cast<std::size_t>(status.st_size);
+        return true;
+#endif
+    }
+
+    /**
+	 * Unmapped the file.
+	 */
+    void close() {
+#if defined(_WIN32)
+        std::vector<char>().swap(m_buffer);
+#else
+        if (m_data)
+            ::munmap(const_cast<char*>(m_data), m_size);
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    ////////////////////////////////////////////////////////////////
+    // How a mapped range is about to be read.
+    enum class Access {
+        Sequential, /* Scanned from the first byte to the last: read ahead aggressively, drop behind. */
+        Random,     /* Jumped around in, e.g. by a tree or graph index: read ahead nothing. */
+    };
+
+    /**
+	 * Told the kernel how `[offset, offset + length)` will be read (`madvise`), and asked for the
+	 * range to be paged in ahead of the first query. A hint only: nothing happens without `mmap`.
+	 */
+    void advise(std::size_t offset, std::size_t length, Access access) const {
+#if !defined(_WIN32)
+        if (!m_data || offset >= m_size)
+            return;
+        // madvise wants a page-aligned start.
+        const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+        const std::size_t begin = offset / page * page;
+        length = std::min(length, m_size - offset) + (offset - begin);
+        char* address = const_cast<char*>(m_data) + begin;
+        ::madvise(address, length, access == Access::Sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        ::madvise(address, length, MADV_WILLNEED);
+#else
+        (void)offset;
+        (void)length;
+        (void)access;
+#endif
+    }
+
+    const char* data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+
+private:
+    const char* m_data = nullptr;
+    std::size_t m_size = 0;
+#if defined(_WIN32)
+    std::vector<char> m_buffer;
+#endif
+};
+
+/**
+ * Wrote `path` through `write(file)`, a callable writing the whole content to the `std::FILE*`
+ * it is given and returning whether it worked, into a temporary file renamed over `path`, so
+ * that a process mapping `path` meanwhile never sees a partial file. Returned whether it worked.
+ */
+template <typename writer>
+bool writeFile(const std::string& path, writer write) {
+    const std::string temporary = path + ".tmp";
+    std::FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (!file)
+        return false;
+    const bool written = write(file);
+    if (std::fclose(file) != 0 || !written) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+#if defined(_WIN32)
+    std::remove(path.c_str());
+#endif
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Wrote `size` bytes to `path`, as above.
+ */
+inline bool writeFile(const std::string& path, const char* data, std::size_t size) {
+    return writeFile(path, [&](std::FILE* file) { return std::fwrite(data, 1, size, file) == size; });
+}
+
+////////////////////////////////////////////////////////////////
+// Training set file: this header, then `size` rows of `dim` values and `size` labels, both sections
+// 64-byte aligned so that the mapped rows are ready for the SIMD kernels.
+struct DataFileHeader {
+    static constexpr char MAGIC[8] = {'K', 'N', 'N', 'D', 'A', 'T', 'A', 0};
+    static constexpr std::uint32_t VERSION = 1;
+    static constexpr std::size_t ALIGNMENT = 64;
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t dataType;  /* `typeTag` of the values. */
+    std::uint32_t labelType; /* `typeTag` of the labels. */
+    std::uint32_t dim;
+    std::uint32_t size;
+    std::uint32_t reserved;
+    std::uint64_t dataBegin;  /* Byte offset of the rows. */
+    std::uint64_t labelBegin; /* Byte offset of the labels. */
+    std::uint64_t fileSize;
+
+    /**
+	 * Kind (float, signed, unsigned, other) and byte size of `T`, so that e.g. a file of `int`
+	 * is not read as `float`.
+	 */
+    template <typename T>
+    static std::uint32_t typeTag() {
+        const std::uint32_t kind = std::is_floating_point<T>::value ? 1 : std::is_signed<T>::value ? 2 : std::is_integral<T>::value ? 3 : 4;
+        return kind << 16 | static_cast<std::uint32_t>(sizeof(T));
+    }
+
+    static std::uint64_t alignUp(std::uint64_t offset) {
+        return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+};
+
+////////////////////////////////////////////////////////////////
+// Model file of `Knn::save`: this header, then an archive (<KnnArchive.h>) of the rows (none when
+// the index keeps its own copy), the classes (distinct labels) and the class of every row, the ids
+// and the tombstones of the rows (none while they are the defaults), and the index. Its fields and
+// arrays are in the byte order of the machine that wrote it, recorded in `endian` so that another
+// one refuses the file.
+struct ModelFileHeader {
+    static constexpr char MAGIC[8] = {'K', 'N', 'N', 'M', 'O', 'D', 'E', 'L'};
+    static constexpr std::uint32_t VERSION = 2;
+    static constexpr std::uint32_t ENDIAN = 0x01020304;
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t endian;    /* ENDIAN, as written. */
+    std::uint32_t dataType;  /* `DataFileHeader::typeTag` of the values. */
+    std::uint32_t labelType; /* `DataFileHeader::typeTag` of the labels. */
+    std::uint32_t dim;
+    std::uint32_t size;
+    std::uint32_t hasRows;  /* Whether the rows are saved. */
+    std::uint32_t hasIndex; /* Whether an index follows the labels. */
+    std::uint32_t indexed;  /* Rows the index holds, the first ones. */
+    std::uint32_t reserved;
+    std::uint64_t nextId;   /* Id of the next row added. */
+
+    /**
+	 * Whether the header was written by this version, on a machine of this byte order, for
+	 * `data_type` rows and `label_type` labels.
+	 */
+    template <typename data_type, typename label_type>
+    bool valid() const {
+        return std::memcmp(magic, MAGIC, sizeof(magic)) == 0 && version == VERSION && endian == ENDIAN &&
+               dataType == DataFileHeader::typeTag<data_type>() && labelType == DataFileHeader::typeTag<label_type>() && dim && size;
+    }
+};
+
+/**
+ * Wrote `size` rows of `dim` values and their labels to the training set file `path`.
+ * Returned whether it worked.
+ */
+template <typename data_type, typename label_type>
+bool writeDataFile(const std::string& path, const data_type* data, unsigned int dim, const label_type* labels, unsigned int size) {
+    static_assert(std::is_trivially_copyable<label_type>::value, "a training set file holds labels of a trivially copyable type");
+    DataFileHeader header{};
+    std::memcpy(header.magic, DataFileHeader::MAGIC, sizeof(header.magic));
+    header.version = DataFileHeader::VERSION;
+    header.dataType = DataFileHeader::typeTag<data_type>();
+    header.labelType = DataFileHeader::typeTag<label_type>();
+    header.dim = dim;
+    header.size = size;
+    header.dataBegin = DataFileHeader::alignUp(sizeof(DataFileHeader));
+    header.labelBegin = DataFileHeader::alignUp(header.dataBegin + static_cast<std::uint64_t>(dim) * size * sizeof(data_type));
+    header.fileSize = header.labelBegin + static_cast<std::uint64_t>(size) * sizeof(label_type);
+
+    std::vector<char> block(static_cast<std::size_t>(header.fileSize), 0);
+    std::memcpy(block.data(), &header, sizeof(header));
+    std::memcpy(block.data() + header.dataBegin, data, static_cast<std::size_t>(dim) * size * sizeof(data_type));
+    std::memcpy(block.data() + header.labelBegin, labels, static_cast<std::size_t>(size) * sizeof(label_type));
+    return writeFile(path, block.data(), block.size());
+}
+
+/**
+ * Checked that `file` is a training set file of `data_type` rows and `label_type` labels, and
+ * returned its header, or nullptr.
+ */
+template <typename data_type, typename label_type>
+const DataFileHeader* readDataFile(const MappedFile& file) {
+    if (file.size() < sizeof(DataFileHeader))
+        return nullptr;
+    const DataFileHeader* header = reinterpret_cast<const DataFileHeader*>(file.data());
+    const std::uint64_t rowsEnd = header->dataBegin + static_cast<std::uint64_t>(header->dim) * header->size * sizeof(data_type);
+    const bool valid = std::memcmp(header->magic, DataFileHeader::MAGIC, sizeof(header->magic)) == 0 &&
+                       header->version == DataFileHeader::VERSION &&
+                       header->dataType == DataFileHeader::typeTag<data_type>() &&
+                       header->labelType == DataFileHeader::typeTag<label_type>() &&
+                       header->dim && header->size && header->dataBegin % DataFileHeader::ALIGNMENT == 0 &&
+                       header->labelBegin % alignof(label_type) == 0 && rowsEnd <= header->labelBegin &&
+                       header->labelBegin + static_cast<std::uint64_t>(header->size) * sizeof(label_type) <= header->fileSize &&
+                       header->fileSize == file.size();
+    return valid ? header : nullptr;
+}
+} // namespace KNN
@@ -0,0 +1,359 @@
+//
+// KnnHalf.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnHalf.h> header.
+// Half-precision storage for <Knn.h>: every value is stored in 16 bits, as an IEEE fp16 or as a bfloat16 (the
+// upper half of a float), so the scan reads half the bytes of a float training set and a quarter of those of
+// a double one, with no quantizer to train. The kernels widen the stored values to float in registers (F16C /
+// AVX-512F for fp16, a 16-bit shift for bf16) and accumulate in float against a float query; the rows are
+// rounded to nearest-even once, at build (F16C, and AVX-512 BF16 where present).
+// fp16 keeps 11 significant bits over [6e-8, 65504] (larger values become infinite); bf16 keeps 8 over the
+// whole float range.
+//
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "KnnBase.h"
+#include "KnnSimd.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+template <typename data_type>
+class Half;
+
+////////////////////////////////////////////////////////////////
+// 16-bit floating-point formats.
+enum class HalfFormat {
+    Fp16, /* IEEE 754 binary16: 5 exponent bits, 10 mantissa bits. */
+    Bf16  /* bfloat16: 8 exponent bits, 7 mantissa bits. */
+};
+
+////////////////////////////////////////////////////////////////
+// Parameters of the half-precision storage.
+struct HalfParams {
+    HalfFormat format = HalfFormat::Fp16;
+
+    template <typename data_type>
+    using index = Half<data_type>;
+};
+
+////////////////////////////////////////////////////////////////
+// Conversions and squared L2 kernels between 16-bit rows and float queries, `dim` a multiple of 16.
+namespace half {
+
+using DistanceFunc = float (*)(const std::uint16_t* row, const float* query, std::size_t dim);
+using EncodeFunc = void (*)(const float* values, std::size_t count, std::uint16_t* out);
+
+inline std::uint32_t bitsOf(float value) {
+    std::uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline float floatOf(std::uint32_t bits) {
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ * Rounded to the nearest fp16, ties to even.
+ */
+inline std::uint16_t toFp16(float value) {
+    std::uint32_t bits = bitsOf(value);
+    const std::uint16_t sign = static_cast<std::uint16_t>((bits >> 16) & 0x8000u);
+    bits &= 0x7fffffffu;
+    if (bits >= 0x7f800000u) // infinity, NaN
+        return sign | 0x7c00u | (bits > 0x7f800000u ? 0x0200u : 0u);
+    if (bits >= 0x477ff000u) // from 65520 on, rounded to infinity
+        return sign | 0x7c00u;
+    if (bits < 0x38800000u) // below 2^-14: subnormal, in units of 2^-24
+        return sign | static_cast<std::uint16_t>(std::nearbyint(floatOf(bits) * 16777216.0f));
+    const std::uint32_t rounded = bits + 0x0fffu + ((bits >> 13) & 1u);
+    return sign | static_cast<std::uint16_t>((rounded - 0x38000000u) >> 13);
+}
+
+inline float fromFp16(std::uint16_t value) {
+    const std::uint32_t sign = static_cast<std::uint32_t>(value & 0x8000u) << 16;
+    const std::uint32_t exponent = (value >> 10) & 0x1fu;
+    const std::uint32_t mantissa = value & 0x03ffu;
+    if (exponent == 0) {
+        const float magnitude = static_cast<float>(mantissa) * (1.0f / 16777216.0f);
+        return sign ? -magnitude : magnitude;
+    }
+    if (exponent == 0x1fu)
+        return floatOf(sign | 0x7f800000u | (mantissa << 13));
+    return floatOf(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+/**
+ * Rounded to the nearest bf16, ties to even. Float subnormals become zeros, as with AVX-512 BF16.
+ */
+inline std::uint16_t toBf16(float value) {
+    const std::uint32_t bits = bitsOf(value);
+    if ((bits & 0x7fffffffu) > 0x7f800000u) // NaN, kept quiet
+        return static_cast<std::uint16_t>((bits >> 16) | 0x0040u);
+    if ((bits & 0x7f800000u) == 0)
+        return static_cast<std::uint16_t>((bits >> 16) & 0x8000u);
+    return static_cast<std::uint16_t>((bits + 0x7fffu + ((bits >> 16) & 1u)) >> 16);
+}
+
+inline float fromBf16(std::uint16_t value) {
+    return floatOf(static_cast<std::uint32_t>(value) << 16);
+}
+
+inline void encodeFp16Scalar(const float* values, std::size_t count, std::uint16_t* out) {
+    for (std::size_t i = 0; i < count; ++i)
+        out[i] = toFp16(values[i]);
+}
+
+inline void encodeBf16Scalar(const float* values, std::size_t count, std::uint16_t* out) {
+    for (std::size_t i = 0; i < count; ++i)
+        out[i] = toBf16(values[i]);
+}
+
+inline float squaredL2Fp16Scalar(const std::uint16_t* row, const float* query, std::size_t dim) {
+    float result = 0;
+    for (std::size_t i = 0; i < dim; ++i) {
+        const float difference = fromFp16(row[i]) - query[i];
+        result += difference * difference;
+    }
+    return result;
+}
+
+inline float squaredL2Bf16Scalar(const std::uint16_t* row, const float* query, std::size_t dim) {
+    float result = 0;
+    for (std::size_t i = 0; i < dim; ++i) {
+        const float difference = fromBf16(row[i]) - query[i];
+        result += difference * difference;
+    }
+    return result;
+}
+
+#ifdef KNN_SIMD_X86
+
+// GCC 12 reports its own AVX-512 intrinsics as reading uninitialized values (GCC bug 105593).
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+KNN_TARGET("avx2,fma,f16c")
+inline void encodeFp16F16C(const float* values, std::size_t count, std::uint16_t* out) {
+    for (std::size_t i = 0; i < count; i += 8)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_cvtps_ph(_mm256_loadu_ps(values + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+}
+
+KNN_TARGET("avx512f,avx512bf16")
+inline void encodeBf16AVX512(const float* values, std::size_t count, std::uint16_t* out) {
+    for (std::size_t i = 0; i < count; i += 16) {
+        const __m256bh packed = _mm512_cvtneps_pbh(_mm512_loadu_ps(values + i));
+        std::memcpy(out + i, &packed, sizeof(packed));
+    }
+}
+
+KNN_TARGET("avx2,fma,f16c")
+inline float squaredL2Fp16AVX2(const std::uint16_t* row, const float* query, std::size_t dim) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    for (std::size_t i = 0; i < dim; i += 16) {
+        const __m256 d0 = _mm256_sub_ps(_mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i))), _mm256_loadu_ps(query + i));
+        const __m256 d1 = _mm256_sub_ps(_mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i + 8))), _mm256_loadu_ps(query + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    return simd::hsum(_mm256_add_ps(acc0, acc1));
+}
+
+KNN_TARGET("avx512f")
+inline float squaredL2Fp16AVX512(const std::uint16_t* row, const float* query, std::size_t dim) {
+    __m512 acc = _mm512_setzero_ps();
+    for (std::size_t i = 0; i < dim; i += 16) {
+        const __m512 d = _mm512_sub_ps(_mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i))), _mm512_loadu_ps(query + i));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+// A bf16 widens to float by a 16-bit shift of its lane.
+KNN_TARGET("sse4.1")
+inline float squaredL2Bf16SSE(const std::uint16_t* row, const float* query, std::size_t dim) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    for (std::size_t i = 0; i < dim; i += 8) {
+        const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        const __m128 x0 = _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), r));
+        const __m128 x1 = _mm_castsi128_ps(_mm_unpackhi_epi16(_mm_setzero_si128(), r));
+        const __m128 d0 = _mm_sub_ps(x0, _mm_loadu_ps(query + i));
+        const __m128 d1 = _mm_sub_ps(x1, _mm_loadu_ps(query + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    return simd::hsum(_mm_add_ps(acc0, acc1));
+}
+
+KNN_TARGET("avx2,fma")
+inline float squaredL2Bf16AVX2(const std::uint16_t* row, const float* query, std::size_t dim) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    for (std::size_t i = 0; i < dim; i += 16) {
+        const __m256i r0 = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i)));
+        const __m256i r1 = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i + 8)));
+        const __m256 d0 = _mm256_sub_ps(_mm256_castsi256_ps(_mm256_slli_epi32(r0, 16)), _mm256_loadu_ps(query + i));
+        const __m256 d1 = _mm256_sub_ps(_mm256_castsi256_ps(_mm256_slli_epi32(r1, 16)), _mm256_loadu_ps(query + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    return simd::hsum(_mm256_add_ps(acc0, acc1));
+}
+
+KNN_TARGET("avx512f")
+inline float squaredL2Bf16AVX512(const std::uint16_t* row, const float* query, std::size_t dim) {
+    __m512 acc = _mm512_setzero_ps();
+    for (std::size_t i = 0; i < dim; i += 16) {
+        const __m512i r = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i)));
+        const __m512 d = _mm512_sub_ps(_mm512_castsi512_ps(_mm512_slli_epi32(r, 16)), _mm512_loadu_ps(query + i));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // KNN_SIMD_X86
+
+/**
+ * Fastest kernel for `format` at the active level of <KnnSimd.h>.
+ */
+inline DistanceFunc select(HalfFormat format) {
+#ifdef KNN_SIMD_X86
+    const simd::CpuFeatures& cpu = simd::cpu();
+    const simd::Level level = simd::activeLevel();
+    if (format == HalfFormat::Fp16) {
+        if (level == simd::Level::AVX512)
+            return &squaredL2Fp16AVX512;
+        if (level == simd::Level::AVX2 && cpu.f16c)
+            return &squaredL2Fp16AVX2;
+    } else {
+        switch (level) {
+        case simd::Level::AVX512: return &squaredL2Bf16AVX512;
+        case simd::Level::AVX2: return &squaredL2Bf16AVX2;
+        case simd::Level::SSE: return &squaredL2Bf16SSE;
+        default: break;
+        }
+    }
+#endif
+    return format == HalfFormat::Fp16 ? &squaredL2Fp16Scalar : &squaredL2Bf16Scalar;
+}
+
+/**
+ * Fastest encoder for `format` (every one rounds to nearest-even, so they agree).
+ */
+inline EncodeFunc selectEncode(HalfFormat format) {
+#ifdef KNN_SIMD_X86
+    const simd::CpuFeatures& cpu = simd::cpu();
+    const simd::Level level = simd::activeLevel();
+    if (format == HalfFormat::Fp16 && level >= simd::Level::AVX2 && cpu.f16c)
+        return &encodeFp16F16C;
+    if (format == HalfFormat::Bf16 && level == simd::Level::AVX512 && cpu.avx512bf16)
+        return &encodeBf16AVX512;
+#endif
+    return format == HalfFormat::Fp16 ? &encodeFp16Scalar : &encodeBf16Scalar;
+}
+} // namespace half
+
+////////////////////////////////////////////////////////////////
+// Half-precision storage. The distances it reports are squared Euclidean distances to the rounded rows.
+template <typename data_type>
+class Half : public Index<data_type> {
+    using stdVectorHalf = std::vector<std::uint16_t, AlignedAllocator<std::uint16_t>>;
+    using stdVectorFloat = std::vector<float, AlignedAllocator<float>>;
+
+    static constexpr unsigned int PADDING = 16; /* Values per row are padded with zeros to a multiple of it, so the kernels have no tail. */
+
+public:
+    explicit Half(const HalfParams& params = HalfParams()) : m_params(params) {}
+
+    /**
+	 * Rounded every row to 16-bit values.
+	 */
+    void build(const DataSet<data_type>& data) override {
+        m_dim = data.dim();
+        m_size = data.size();
+        m_stride = (m_dim + PADDING - 1) / PADDING * PADDING;
+        m_rows.assign(static_cast<std::size_t>(m_size) * m_stride, 0);
+
+        const half::EncodeFunc encode = half::selectEncode(m_params.format);
+        stdVectorFloat values(m_stride, 0.0f);
+        for (unsigned int i = 0; i < m_size; ++i) {
+            const data_type* row = data.row(i);
+            for (unsigned int d = 0; d < m_dim; ++d)
+                values[d] = static_cast<float>(row[d]);
+            encode(values.data(), m_stride, m_rows.data() + static_cast<std::size_t>(i) * m_stride);
+        }
+    }
+
+    unsigned int search(const data_type* test, unsigned int K, Neighbor* out) const override {
+        if (m_size == 0)
+            return 0;
+        stdVectorFloat query(m_stride, 0.0f);
+        for (unsigned int d = 0; d < m_dim; ++d)
+            query[d] = static_cast<float>(test[d]);
+
+        const half::DistanceFunc distance = half::select(m_params.format);
+        return withTopK(K, [&](auto top) {
+            for (unsigned int i = 0; i < m_size; ++i)
+                top.push(distance(m_rows.data() + static_cast<std::size_t>(i) * m_stride, query.data(), m_stride), i);
+            return top.copyTo(out);
+        });
+    }
+
+    /**
+	 * Only the 16-bit rows are read.
+	 */
+    bool needsData() const override {
+        return false;
+    }
+
+    /**
+	 * Value of dimension `d` of row `i`, as stored.
+	 */
+    float value(unsigned int i, unsigned int d) const {
+        const std::uint16_t stored = m_rows[static_cast<std::size_t>(i) * m_stride + d];
+        return m_params.format == HalfFormat::Fp16 ? half::fromFp16(stored) : half::fromBf16(stored);
+    }
+
+    void save(ArchiveWriter& out) const override {
+        out.tag("Half");
+        out.value(m_params);
+        out.value(m_dim);
+        out.value(m_size);
+        out.value(m_stride);
+        out.vector(m_rows);
+    }
+
+    bool load(ArchiveReader& in, const DataSet<data_type>& data) override {
+        return in.tag("Half") && in.value(m_params) && in.value(m_dim) && in.value(m_size) && in.value(m_stride) && in.vector(m_rows) &&
+               m_dim == data.dim() && (m_params.format == HalfFormat::Fp16 || m_params.format == HalfFormat::Bf16) &&
+               m_stride == (m_dim + PADDING - 1) / PADDING * PADDING && m_rows.size() == static_cast<std::size_t>(m_size) * m_stride;
+    }
+
+private:
+    HalfParams m_params;
+    unsigned int m_dim = 0;
+    unsigned int m_size = 0;
+    unsigned int m_stride = 0; /* Values per row, padded. */
+    stdVectorHalf m_rows;      /* `stride` values per row. */
+};
+} // namespace KNN
@@ -0,0 +1,440 @@
+//
+// KnnHnsw.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnHnsw.h> header.
+// Hierarchical Navigable Small World (HNSW) index for <Knn.h>: approximate K-nearest queries in roughly
+// logarithmic time, for large high-dimensional training sets where an exact scan is too slow.
+// Every row is a node of a layered proximity graph; a query descends greedily through the sparse upper
+// layers and then runs a best-first search of width `efSearch` on the bottom layer.
+//
+// Malkov Y A, Yashunin D A. Efficient and robust approximate nearest neighbor search using
+// Hierarchical Navigable Small World graphs[J]. IEEE TPAMI, 2018.
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "KnnBase.h"
+#include "KnnSimd.h"
+#include "KnnThreadPool.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+template <typename data_type>
+class Hnsw;
+
+////////////////////////////////////////////////////////////////
+// Parameters of the HNSW index.
+struct HnswParams {
+    unsigned int M = 16;               /* Links per node on the upper layers, `2 * M` on the bottom one. */
+    unsigned int efConstruction = 200; /* Search width while linking a new node. */
+    unsigned int efSearch = 64;        /* Search width of a query (at least `K`); larger is slower and more exact. */
+    unsigned int threads = 0;          /* Build threads, 0 for all the cores. */
+    unsigned int seed = 100;           /* Seed of the node levels. */
+
+    template <typename data_type>
+    using index = Hnsw<data_type>;
+};
+
+////////////////////////////////////////////////////////////////
+// HNSW index.
+template <typename data_type>
+class Hnsw : public Index<data_type> {
+    using Candidate = std::pair<double, unsigned int>;
+    using MaxHeap = std::priority_queue<Candidate>;
+    using MinHeap = std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>>;
+
+    static constexpr unsigned int LOCK_STRIPES = 1u << 16; /* Node locks while building. */
+    static constexpr unsigned int MAX_LEVEL = 16;
+
+public:
+    explicit Hnsw(const HnswParams& params = HnswParams()) : m_params(params) {
+        m_params.M = std::max(m_params.M, 2u);
+        m_params.efConstruction = std::max(m_params.efConstruction, m_params.M);
+    }
+
+    /**
+	 * Inserted every row in turn, on `threads` threads; nodes are locked by stripes while
+	 * their links change.
+	 */
+    void build(const DataSet<data_type>& data) override {
+        m_data = &data;
+        m_dim = data.dim();
+        m_distance = simd::squaredL2<data_type>();
+        const unsigned int size = data.size();
+        const unsigned int M = m_params.M;
+
+        // levels are drawn up front, so that the upper links can be allocated before any thread runs.
+        std::mt19937 random(m_params.seed);
+        std::uniform_real_distribution<double> uniform(std::numeric_limits<double>::min(), 1.0);
+        const double mL = 1.0 / std::log(static_cast<double>(M));
+        m_levels.resize(size);
+        m_upper.assign(size, std::vector<unsigned int>());
+        for (unsigned int i = 0; i < size; ++i) {
+            m_levels[i] = std::min(static_cast<unsigned int>(-std::log(uniform(random)) * mL), MAX_LEVEL);
+            if (m_levels[i])
+                m_upper[i].assign(static_cast<std::size_t>(m_levels[i]) * (M + 1), 0);
+        }
+        m_links.assign(static_cast<std::size_t>(size) * (2 * M + 1), 0);
+        if (size == 0)
+            return;
+
+        m_entry = 0;
+        m_maxLevel = m_levels[0];
+        m_locks.reset(new std::mutex[LOCK_STRIPES]);
+
+        unsigned int threads = m_params.threads ? m_params.threads : std::thread::hardware_concurrency();
+        threads = std::max(1u, std::min(threads, size));
+        std::atomic<unsigned int> next{1};
+        auto work = [&](unsigned int) {
+            for (unsigned int i; (i = next.fetch_add(1)) < size;)
+                insert(i);
+        };
+        if (threads > 1)
+            ThreadPool(threads).run(threads, work);
+        else
+            work(0);
+
+        m_locks.reset();
+    }
+
+    unsigned int search(const data_type* test, unsigned int K, Neighbor* out) const override {
+        if (m_levels.empty())
+            return 0;
+        unsigned int entry = m_entry;
+        double entryDistance = distance(entry, test);
+        for (unsigned int level = m_maxLevel; level > 0; --level)
+            greedy(test, entry, entryDistance, level);
+
+        MaxHeap found = searchLayer(test, entry, entryDistance, std::max(m_params.efSearch, K), 0);
+        while (found.size() > K)
+            found.pop();
+        const unsigned int count = static_cast<unsigned int>(found.size());
+        for (unsigned int i = count; i--; found.pop())
+            out[i] = Neighbor{found.top().first, found.top().second};
+        return count;
+    }
+
+    /**
+	 * Changed the search width of the next queries. Not thread-safe: call it between queries.
+	 */
+    void setEfSearch(unsigned int efSearch) {
+        m_params.efSearch = efSearch;
+    }
+
+    /**
+	 * Drew the level of the new node and linked it in, as `build` does, but without the node
+	 * locks: the caller (`Knn::add`) holds off the queries meanwhile.
+	 */
+    bool insert(const DataSet<data_type>& data, unsigned int row) override {
+        if (&data != m_data || row != m_levels.size())
+            return false;
+        const unsigned int M = m_params.M;
+        std::mt19937 random(m_params.seed + row);
+        std::uniform_real_distribution<double> uniform(std::numeric_limits<double>::min(), 1.0);
+        const double mL = 1.0 / std::log(static_cast<double>(M));
+        const unsigned int level = std::min(static_cast<unsigned int>(-std::log(uniform(random)) * mL), MAX_LEVEL);
+        m_levels.push_back(level);
+        m_upper.emplace_back(static_cast<std::size_t>(level) * (M + 1), 0u);
+        m_links.resize(m_links.size() + 2 * M + 1, 0);
+        if (row == 0) {
+            m_entry = 0;
+            m_maxLevel = level;
+            return true;
+        }
+        insert(row);
+        return true;
+    }
+
+    /**
+	 * The upper links are saved as one array, in node order.
+	 */
+    void save(ArchiveWriter& out) const override {
+        out.tag("Hnsw");
+        out.value(m_params);
+        out.value(m_dim);
+        out.value(m_entry);
+        out.value(m_maxLevel);
+        out.vector(m_levels);
+        out.vector(m_links);
+        std::vector<unsigned int> upper;
+        for (const std::vector<unsigned int>& node : m_upper)
+            upper.insert(upper.end(), node.begin(), node.end());
+        out.vector(upper);
+    }
+
+    bool load(ArchiveReader& in, const DataSet<data_type>& data) override {
+        const unsigned int* upper = nullptr;
+        std::size_t count = 0;
+        if (!(in.tag("Hnsw") && in.value(m_params) && in.value(m_dim) && in.value(m_entry) && in.value(m_maxLevel) &&
+              in.vector(m_levels) && in.vector(m_links) && in.array(upper, count)) ||
+            m_levels.size() > data.size() || m_dim != data.dim() || m_params.M < 2 ||
+            m_links.size() != m_levels.size() * (2 * static_cast<std::size_t>(m_params.M) + 1))
+            return false;
+        m_upper.assign(m_levels.size(), std::vector<unsigned int>());
+        std::size_t offset = 0;
+        for (std::size_t i = 0; i < m_levels.size(); ++i) {
+            const std::size_t slots = static_cast<std::size_t>(m_levels[i]) * (m_params.M + 1);
+            if (offset + slots > count)
+                return false;
+            m_upper[i].assign(upper + offset, upper + offset + slots);
+            offset += slots;
+        }
+        m_data = &data;
+        m_distance = simd::squaredL2<data_type>();
+        return offset == count && consistent();
+    }
+
+private:
+    /**
+	 * Whether the entry point and every link of a loaded graph are in range: a link on a level
+	 * leads to a node of that level at least, and lists hold at most `maxLinks` links.
+	 */
+    bool consistent() const {
+        const std::size_t size = m_levels.size();
+        if (size == 0)
+            return true;
+        if (m_entry >= size || m_maxLevel > m_levels[m_entry])
+            return false;
+        for (std::size_t node = 0; node < size; ++node) {
+            if (m_levels[node] > MAX_LEVEL)
+                return false;
+            for (unsigned int level = 0; level <= m_levels[node]; ++level) {
+                const unsigned int* list = links(static_cast<unsigned int>(node), level);
+                if (list[0] > maxLinks(level))
+                    return false;
+                for (unsigned int i = 1; i <= list[0]; ++i)
+                    if (list[i] >= size || m_levels[list[i]] < level)
+                        return false;
+            }
+        }
+        return true;
+    }
+
+    double distance(unsigned int node, const data_type* test) const {
+        return m_distance(m_data->row(node), test, m_dim);
+    }
+
+    unsigned int maxLinks(unsigned int level) const {
+        return level ? m_params.M : 2 * m_params.M;
+    }
+
+    /**
+	 * Links of `node` on `level`: a count followed by `maxLinks(level)` slots.
+	 */
+    unsigned int* links(unsigned int node, unsigned int level) {
+        return level ? m_upper[node].data() + static_cast<std::size_t>(level - 1) * (m_params.M + 1)
+                     : m_links.data() + static_cast<std::size_t>(node) * (2 * m_params.M + 1);
+    }
+
+    const unsigned int* links(unsigned int node, unsigned int level) const {
+        return const_cast<Hnsw*>(this)->links(node, level);
+    }
+
+    /**
+	 * Called `f` with the links of `node`; while building, a copy taken under the node lock.
+	 */
+    template <typename function>
+    void forLinks(unsigned int node, unsigned int level, function&& f) const {
+        if (m_locks) {
+            unsigned int copy[2 * MAX_LINKS_HINT + 1];
+            std::vector<unsigned int> large;
+            unsigned int* buffer = copy;
+            if (maxLinks(level) > 2 * MAX_LINKS_HINT) {
+                large.resize(maxLinks(level) + 1);
+                buffer = large.data();
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_locks[node % LOCK_STRIPES]);
+                const unsigned int* list = links(node, level);
+                std::copy(list, list + list[0] + 1, buffer);
+            }
+            for (unsigned int i = 1; i <= buffer[0]; ++i)
+                f(buffer[i]);
+        } else {
+            const unsigned int* list = links(node, level);
+            for (unsigned int i = 1; i <= list[0]; ++i)
+                f(list[i]);
+        }
+    }
+
+    /**
+	 * Moved `entry` to its nearest link on `level` until no link is nearer to `test`.
+	 */
+    void greedy(const data_type* test, unsigned int& entry, double& entryDistance, unsigned int level) const {
+        for (bool moved = true; moved;) {
+            moved = false;
+            const unsigned int current = entry;
+            forLinks(current, level, [&](unsigned int link) {
+                const double d = distance(link, test);
+                if (d < entryDistance) {
+                    entryDistance = d;
+                    entry = link;
+                    moved = true;
+                }
+            });
+        }
+    }
+
+    /**
+	 * Best-first search of `level` from `entry`, returned the `ef` nearest nodes found.
+	 */
+    MaxHeap searchLayer(const data_type* test, unsigned int entry, double entryDistance, unsigned int ef, unsigned int level) const {
+        VisitedSet& visited = VisitedSet::local();
+        visited.reset(m_levels.size());
+        visited.visit(entry);
+
+        MinHeap candidates;
+        MaxHeap found;
+        candidates.emplace(entryDistance, entry);
+        found.emplace(entryDistance, entry);
+        while (!candidates.empty()) {
+            const Candidate nearest = candidates.top();
+            if (nearest.first > found.top().first && found.size() >= ef)
+                break;
+            candidates.pop();
+            forLinks(nearest.second, level, [&](unsigned int link) {
+                if (!visited.visit(link))
+                    return;
+                const double d = distance(link, test);
+                if (found.size() < ef || d < found.top().first) {
+                    candidates.emplace(d, link);
+                    found.emplace(d, link);
+                    if (found.size() > ef)
+                        found.pop();
+                }
+            });
+        }
+        return found;
+    }
+
+    /**
+	 * Kept at most `M` of `candidates` (nearest first), skipping a candidate that is nearer to
+	 * an already kept one than to the base node, so that the links spread in all directions.
+	 */
+    std::vector<unsigned int> selectNeighbors(MaxHeap candidates, unsigned int M) const {
+        std::vector<Candidate> sorted;
+        sorted.reserve(candidates.size());
+        for (; !candidates.empty(); candidates.pop())
+            sorted.push_back(candidates.top());
+        std::reverse(sorted.begin(), sorted.end());
+
+        std::vector<unsigned int> selected;
+        selected.reserve(M);
+        for (const Candidate& candidate : sorted) {
+            if (selected.size() >= M)
+                break;
+            bool keep = true;
+            for (unsigned int kept : selected) {
+                if (distance(kept, m_data->row(candidate.second)) < candidate.first) {
+                    keep = false;
+                    break;
+                }
+            }
+            if (keep)
+                selected.push_back(candidate.second);
+        }
+        return selected;
+    }
+
+    void insert(unsigned int node) {
+        const unsigned int level = m_levels[node];
+        const data_type* point = m_data->row(node);
+
+        // a node above the current top holds the entry lock for its whole insertion.
+        std::unique_lock<std::mutex> entryLock(m_entryMutex);
+        unsigned int entry = m_entry;
+        const unsigned int maxLevel = m_maxLevel;
+        if (level <= maxLevel)
+            entryLock.unlock();
+
+        double entryDistance = distance(entry, point);
+        for (unsigned int l = maxLevel; l > level; --l)
+            greedy(point, entry, entryDistance, l);
+
+        for (unsigned int l = std::min(level, maxLevel) + 1; l--;) {
+            MaxHeap found = searchLayer(point, entry, entryDistance, m_params.efConstruction, l);
+            const std::vector<unsigned int> selected = selectNeighbors(found, m_params.M);
+            {
+                auto lock = nodeLock(node);
+                unsigned int* list = links(node, l);
+                list[0] = static_cast<unsigned int>(selected.size());
+                std::copy(selected.begin(), selected.end(), list + 1);
+            }
+            for (unsigned int neighbor : selected)
+                link(neighbor, node, l);
+
+            // the nearest node found enters the next layer down.
+            while (found.size() > 1)
+                found.pop();
+            entry = found.top().second;
+            entryDistance = found.top().first;
+        }
+
+        if (level > maxLevel) {
+            m_entry = node;
+            m_maxLevel = level;
+        }
+    }
+
+    /**
+	 * Lock of `node` while building, none otherwise.
+	 */
+    std::unique_lock<std::mutex> nodeLock(unsigned int node) const {
+        return m_locks ? std::unique_lock<std::mutex>(m_locks[node % LOCK_STRIPES]) : std::unique_lock<std::mutex>();
+    }
+
+    /**
+	 * Added the back link `neighbor -> node`, pruning the links of `neighbor` when full.
+	 */
+    void link(unsigned int neighbor, unsigned int node, unsigned int level) {
+        auto lock = nodeLock(neighbor);
+        unsigned int* list = links(neighbor, level);
+        const unsigned int capacity = maxLinks(level);
+        if (list[0] < capacity) {
+            list[++list[0]] = node;
+            return;
+        }
+
+        const data_type* base = m_data->row(neighbor);
+        MaxHeap candidates;
+        candidates.emplace(distance(node, base), node);
+        for (unsigned int i = 1; i <= list[0]; ++i)
+            candidates.emplace(distance(list[i], base), list[i]);
+        const std::vector<unsigned int> selected = selectNeighbors(std::move(candidates), capacity);
+        list[0] = static_cast<unsigned int>(selected.size());
+        std::copy(selected.begin(), selected.end(), list + 1);
+    }
+
+    static constexpr unsigned int MAX_LINKS_HINT = 32; /* `M` up to which link copies stay on the stack. */
+
+    HnswParams m_params;
+    const DataSet<data_type>* m_data = nullptr;
+    unsigned int m_dim = 0;
+    simd::DistanceFunc<data_type> m_distance = nullptr;
+    std::vector<unsigned int> m_levels;             /* Top level of every node. */
+    std::vector<unsigned int> m_links;              /* Bottom layer links, `2 * M + 1` slots per node. */
+    std::vector<std::vector<unsigned int>> m_upper; /* Upper layer links, `M + 1` slots per level per node. */
+    unsigned int m_entry = 0;
+    unsigned int m_maxLevel = 0;
+    std::unique_ptr<std::mutex[]> m_locks; /* While building. */
+    std::mutex m_entryMutex;
+};
+} // namespace KNN
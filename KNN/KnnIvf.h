@@ -0,0 +1,299 @@
+//
+// KnnIvf.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnIvf.h> header.
+// Inverted file (IVF) index for <Knn.h>: k-means splits the training set into `nlist` cells, and a query
+// only scans the rows of the `nprobe` cells whose centroids are nearest to it. The rows of every cell are
+// copied contiguously, so each probed cell is a plain SIMD scan; as with <KnnKdTree.h>, the classifier keeps
+// its own rows too (for the rows added after the build and the compactions), so the data is held twice.
+//
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "KnnBase.h"
+#include "KnnSimd.h"
+#include "KnnThreadPool.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+template <typename data_type>
+class Ivf;
+
+////////////////////////////////////////////////////////////////
+// Parameters of the IVF index.
+struct IvfParams {
+    unsigned int nlist = 0;            /* Cells, 0 for about sqrt(size). */
+    unsigned int nprobe = 8;           /* Cells scanned by a query; larger is slower and more exact. */
+    unsigned int iterations = 10;      /* k-means iterations. */
+    unsigned int samplesPerList = 256; /* k-means trains on at most `nlist * samplesPerList` rows. */
+    unsigned int threads = 0;          /* Build threads, 0 for all the cores. */
+    unsigned int seed = 100;           /* Seed of the k-means sampling. */
+
+    template <typename data_type>
+    using index = Ivf<data_type>;
+};
+
+////////////////////////////////////////////////////////////////
+// k-means coarse quantizer: `count` centroids of `dim` values, stored like the training set.
+template <typename data_type>
+class KMeans {
+    using stdVectorData = std::vector<data_type, AlignedAllocator<data_type>>;
+
+public:
+    /**
+	 * Lloyd iterations over the rows `samples` of `data`, seeded with randomly picked rows.
+	 * A cell left empty is reseeded with a random sample.
+	 */
+    void train(const DataSet<data_type>& data, const std::vector<unsigned int>& samples, unsigned int count,
+               unsigned int iterations, std::mt19937& random, ThreadPool* pool) {
+        m_dim = data.dim();
+        m_count = count;
+        m_distance = simd::squaredL2<data_type>();
+        m_centroids.resize(static_cast<std::size_t>(count) * m_dim);
+        for (unsigned int c = 0; c < count; ++c)
+            std::copy(data.row(samples[c]), data.row(samples[c]) + m_dim, centroid(c));
+
+        std::vector<unsigned int> assignment(samples.size());
+        std::vector<double> sums(static_cast<std::size_t>(count) * m_dim);
+        std::vector<unsigned int> sizes(count);
+        std::uniform_int_distribution<std::size_t> pick(0, samples.size() - 1);
+        for (unsigned int iteration = 0; iteration < iterations; ++iteration) {
+            forEach(pool, static_cast<unsigned int>(samples.size()), [&](unsigned int i) {
+                assignment[i] = nearest(data.row(samples[i]));
+            });
+
+            std::fill(sums.begin(), sums.end(), 0.0);
+            std::fill(sizes.begin(), sizes.end(), 0u);
+            for (std::size_t i = 0; i < samples.size(); ++i) {
+                const data_type* row = data.row(samples[i]);
+                double* sum = sums.data() + static_cast<std::size_t>(assignment[i]) * m_dim;
+                for (unsigned int d = 0; d < m_dim; ++d)
+                    sum[d] += static_cast<double>(row[d]);
+                ++sizes[assignment[i]];
+            }
+            for (unsigned int c = 0; c < count; ++c) {
+                data_type* target = centroid(c);
+                if (sizes[c] == 0) {
+                    const data_type* row = data.row(samples[pick(random)]);
+                    std::copy(row, row + m_dim, target);
+                    continue;
+                }
+                const double* sum = sums.data() + static_cast<std::size_t>(c) * m_dim;
+                for (unsigned int d = 0; d < m_dim; ++d)
+                    target[d] = toData(sum[d] / sizes[c]);
+            }
+        }
+    }
+
+    /**
+	 * Nearest centroid of `row`.
+	 */
+    unsigned int nearest(const data_type* row) const {
+        unsigned int best = 0;
+        double bestDistance = std::numeric_limits<double>::infinity();
+        for (unsigned int c = 0; c < m_count; ++c) {
+            const double d = m_distance(centroid(c), row, m_dim);
+            if (d < bestDistance) {
+                bestDistance = d;
+                best = c;
+            }
+        }
+        return best;
+    }
+
+    /**
+	 * Squared distances from `row` to every centroid.
+	 */
+    void distances(const data_type* row, double* out) const {
+        for (unsigned int c = 0; c < m_count; ++c)
+            out[c] = m_distance(centroid(c), row, m_dim);
+    }
+
+    const data_type* centroid(unsigned int c) const { return m_centroids.data() + static_cast<std::size_t>(c) * m_dim; }
+    data_type* centroid(unsigned int c) { return m_centroids.data() + static_cast<std::size_t>(c) * m_dim; }
+    unsigned int count() const { return m_count; }
+    unsigned int dim() const { return m_dim; }
+
+    void save(ArchiveWriter& out) const {
+        out.value(m_dim);
+        out.value(m_count);
+        out.vector(m_centroids);
+    }
+
+    bool load(ArchiveReader& in) {
+        if (!(in.value(m_dim) && in.value(m_count) && in.vector(m_centroids)) || m_centroids.size() != static_cast<std::size_t>(m_dim) * m_count)
+            return false;
+        m_distance = simd::squaredL2<data_type>();
+        return true;
+    }
+
+    /**
+	 * Called `f(i)` for every `i` in [0, `count`), split over `pool` if there is one.
+	 */
+    template <typename function>
+    static void forEach(ThreadPool* pool, unsigned int count, function&& f) {
+        if (!pool) {
+            for (unsigned int i = 0; i < count; ++i)
+                f(i);
+            return;
+        }
+        const unsigned int parts = pool->size();
+        pool->run(parts, [&](unsigned int part) {
+            const unsigned int first = static_cast<unsigned int>(static_cast<std::size_t>(count) * part / parts);
+            const unsigned int last = static_cast<unsigned int>(static_cast<std::size_t>(count) * (part + 1) / parts);
+            for (unsigned int i = first; i < last; ++i)
+                f(i);
+        });
+    }
+
+private:
+    static data_type toData(double value) {
+        if constexpr (std::is_integral<data_type>::value)
+            return static_cast<data_type>(std::lround(value));
+        else
+            return static_cast<data_type>(value);
+    }
+
+    stdVectorData m_centroids;
+    unsigned int m_dim = 0;
+    unsigned int m_count = 0;
+    simd::DistanceFunc<data_type> m_distance = nullptr;
+};
+
+////////////////////////////////////////////////////////////////
+// IVF index.
+template <typename data_type>
+class Ivf : public Index<data_type> {
+    using stdVectorData = std::vector<data_type, AlignedAllocator<data_type>>;
+
+public:
+    explicit Ivf(const IvfParams& params = IvfParams()) : m_params(params) {}
+
+    /**
+	 * Trained the centroids on a sample of the rows, then filed every row under its nearest one.
+	 */
+    void build(const DataSet<data_type>& data) override {
+        m_dim = data.dim();
+        const unsigned int size = data.size();
+        if (size == 0) {
+            m_quantizer = KMeans<data_type>();
+            m_listBegin.assign(1, 0);
+            m_order.clear();
+            m_points.clear();
+            return;
+        }
+        unsigned int nlist = m_params.nlist ? m_params.nlist : static_cast<unsigned int>(std::sqrt(static_cast<double>(size)));
+        nlist = std::max(1u, std::min(nlist, size));
+
+        unsigned int threads = m_params.threads ? m_params.threads : std::thread::hardware_concurrency();
+        std::unique_ptr<ThreadPool> pool(threads > 1 ? new ThreadPool(threads) : nullptr);
+
+        // k-means on a random sample.
+        std::mt19937 random(m_params.seed);
+        std::vector<unsigned int> samples(size);
+        std::iota(samples.begin(), samples.end(), 0u);
+        const std::size_t sampleCount = std::min<std::size_t>(size, static_cast<std::size_t>(nlist) * std::max(1u, m_params.samplesPerList));
+        for (std::size_t i = 0; i < sampleCount; ++i)
+            std::swap(samples[i], samples[i + random() % (size - i)]);
+        samples.resize(sampleCount);
+        m_quantizer.train(data, samples, nlist, m_params.iterations, random, pool.get());
+
+        // inverted lists.
+        std::vector<unsigned int> assignment(size);
+        KMeans<data_type>::forEach(pool.get(), size, [&](unsigned int i) {
+            assignment[i] = m_quantizer.nearest(data.row(i));
+        });
+        m_listBegin.assign(nlist + 1, 0);
+        for (unsigned int i = 0; i < size; ++i)
+            ++m_listBegin[assignment[i] + 1];
+        std::partial_sum(m_listBegin.begin(), m_listBegin.end(), m_listBegin.begin());
+
+        std::vector<unsigned int> cursor(m_listBegin.begin(), m_listBegin.end() - 1);
+        m_order.resize(size);
+        m_points.resize(static_cast<std::size_t>(size) * m_dim);
+        for (unsigned int i = 0; i < size; ++i) {
+            const unsigned int slot = cursor[assignment[i]]++;
+            m_order[slot] = i;
+            std::copy(data.row(i), data.row(i) + m_dim, m_points.data() + static_cast<std::size_t>(slot) * m_dim);
+        }
+    }
+
+    unsigned int search(const data_type* test, unsigned int K, Neighbor* out) const override {
+        const unsigned int nlist = m_quantizer.count();
+        if (nlist == 0)
+            return 0;
+
+        std::vector<std::pair<double, unsigned int>> cells(nlist);
+        std::vector<double> distances(nlist);
+        m_quantizer.distances(test, distances.data());
+        for (unsigned int c = 0; c < nlist; ++c)
+            cells[c] = std::make_pair(distances[c], c);
+        const unsigned int nprobe = std::max(1u, std::min(m_params.nprobe, nlist));
+        std::partial_sort(cells.begin(), cells.begin() + nprobe, cells.end());
+
+        const auto squaredL2 = simd::squaredL2<data_type>();
+        return withTopK(K, [&](auto top) {
+            for (unsigned int p = 0; p < nprobe; ++p) {
+                const unsigned int c = cells[p].second;
+                for (unsigned int i = m_listBegin[c]; i < m_listBegin[c + 1]; ++i)
+                    top.push(squaredL2(m_points.data() + static_cast<std::size_t>(i) * m_dim, test, m_dim), m_order[i]);
+            }
+            return top.copyTo(out);
+        });
+    }
+
+    /**
+	 * Changed the cells scanned by the next queries. Not thread-safe: call it between queries.
+	 */
+    void setNprobe(unsigned int nprobe) {
+        m_params.nprobe = nprobe;
+    }
+
+    void save(ArchiveWriter& out) const override {
+        out.tag("Ivf");
+        out.value(m_params);
+        out.value(m_dim);
+        m_quantizer.save(out);
+        out.vector(m_listBegin);
+        out.vector(m_order);
+        out.vector(m_points);
+    }
+
+    /**
+	 * The lists are checked to cover `m_order` in order, and to hold rows of `data`.
+	 */
+    bool load(ArchiveReader& in, const DataSet<data_type>& data) override {
+        if (!(in.tag("Ivf") && in.value(m_params) && in.value(m_dim) && m_quantizer.load(in) && in.vector(m_listBegin) &&
+              in.vector(m_order) && in.vector(m_points)) ||
+            m_dim != data.dim() || m_quantizer.dim() != m_dim || m_listBegin.size() != m_quantizer.count() + std::size_t(1) ||
+            m_listBegin.front() != 0 || m_listBegin.back() != m_order.size() || m_points.size() != m_order.size() * m_dim ||
+            !std::is_sorted(m_listBegin.begin(), m_listBegin.end()))
+            return false;
+        return std::all_of(m_order.begin(), m_order.end(), [&](unsigned int row) { return row < data.size(); });
+    }
+
+private:
+    IvfParams m_params;
+    unsigned int m_dim = 0;
+    KMeans<data_type> m_quantizer;
+    std::vector<unsigned int> m_listBegin; /* Per cell, into `m_order`, plus the end. */
+    std::vector<unsigned int> m_order;     /* Training row of every list-ordered row. */
+    stdVectorData m_points;                /* Rows in list order. */
+};
+} // namespace KNN
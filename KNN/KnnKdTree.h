@@ -0,0 +1,217 @@
+//
+// KnnKdTree.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnKdTree.h> header.
+// KD-tree index for <Knn.h>: exact K-nearest queries in O(log N) expected time for low dimensions (D <= ~20).
+// The tree is balanced (median splits) and stored as an implicit array: node `i` has the children `2i+1` and `2i+2`,
+// and the rows of every leaf are copied next to each other, so a query walks a few arrays instead of pointers.
+//
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <numeric>
+#include <vector>
+
+#include "KnnBase.h"
+#include "KnnSimd.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+template <typename data_type>
+class KdTree;
+
+////////////////////////////////////////////////////////////////
+// Parameters of the KD-tree index.
+struct KdTreeParams {
+    unsigned int leafSize = 32; /* Maximum rows per leaf bucket. */
+
+    template <typename data_type>
+    using index = KdTree<data_type>;
+};
+
+////////////////////////////////////////////////////////////////
+// KD-tree index.
+template <typename data_type>
+class KdTree : public Index<data_type> {
+    using stdVectorData = std::vector<data_type, AlignedAllocator<data_type>>;
+
+    static constexpr unsigned int MAX_DEPTH = 30;
+
+public:
+    explicit KdTree(const KdTreeParams& params = KdTreeParams()) : m_params(params) {
+        if (m_params.leafSize == 0)
+            m_params.leafSize = 1;
+    }
+
+    /**
+	 * Split every node at the median of its widest dimension, down to `depth` levels
+	 * where no leaf holds more than `leafSize` rows.
+	 */
+    void build(const DataSet<data_type>& data) override {
+        m_dim = data.dim();
+        const unsigned int size = data.size();
+
+        m_depth = 0;
+        if (!size) {
+            // one empty leaf, which `search` does not visit.
+            m_order.clear();
+            m_splitDim.clear();
+            m_splitValue.clear();
+            m_leafBegin.assign(2, 0);
+            m_points.clear();
+            return;
+        }
+        const unsigned int leafSize = std::max(m_params.leafSize, 1u); // params read by `load` skip the constructor.
+        while (m_depth < MAX_DEPTH && ((size - 1) >> m_depth) + 1 > leafSize)
+            ++m_depth;
+        const unsigned int leaves = 1u << m_depth;
+
+        m_order.resize(size);
+        std::iota(m_order.begin(), m_order.end(), 0u);
+        m_splitDim.assign(leaves - 1, 0);
+        m_splitValue.assign(leaves - 1, 0);
+        m_leafBegin.assign(leaves + 1, size);
+        buildNode(data, 0, 0, 0, size);
+
+        // leaf rows laid out in tree order.
+        m_points.resize(static_cast<std::size_t>(size) * m_dim);
+        for (unsigned int i = 0; i < size; ++i)
+            std::copy(data.row(m_order[i]), data.row(m_order[i]) + m_dim, m_points.data() + static_cast<std::size_t>(i) * m_dim);
+    }
+
+    unsigned int search(const data_type* test, unsigned int K, Neighbor* out) const override {
+        if (m_order.empty())
+            return 0;
+        return withTopK(K, [&](auto top) {
+            // offsets[d]: distance along `d` from `test` to the cell being visited.
+            std::vector<double> offsets(m_dim, 0.0);
+            Query<decltype(top)> query{test, top, offsets.data(), simd::squaredL2<data_type>()};
+            searchNode(query, 0, 0, 0.0);
+            return top.copyTo(out);
+        });
+    }
+
+    void save(ArchiveWriter& out) const override {
+        out.tag("KdTree");
+        out.value(m_params);
+        out.value(m_dim);
+        out.value(m_depth);
+        out.vector(m_splitDim);
+        out.vector(m_splitValue);
+        out.vector(m_leafBegin);
+        out.vector(m_order);
+        out.vector(m_points);
+    }
+
+    bool load(ArchiveReader& in, const DataSet<data_type>& data) override {
+        return in.tag("KdTree") && in.value(m_params) && in.value(m_dim) && in.value(m_depth) && in.vector(m_splitDim) &&
+               in.vector(m_splitValue) && in.vector(m_leafBegin) && in.vector(m_order) && in.vector(m_points) && consistent(data);
+    }
+
+private:
+    /**
+	 * Whether the arrays of a loaded tree have the sizes of its depth, its leaves cover `m_order`
+	 * in order, and its split dimensions and rows are in range.
+	 */
+    bool consistent(const DataSet<data_type>& data) const {
+        if (m_dim != data.dim() || m_depth > MAX_DEPTH)
+            return false;
+        const std::size_t leaves = std::size_t(1) << m_depth;
+        if (m_splitDim.size() != leaves - 1 || m_splitValue.size() != leaves - 1 || m_leafBegin.size() != leaves + 1 ||
+            m_leafBegin.front() != 0 || m_leafBegin.back() != m_order.size() || !std::is_sorted(m_leafBegin.begin(), m_leafBegin.end()) ||
+            m_points.size() != m_order.size() * m_dim)
+            return false;
+        return std::all_of(m_splitDim.begin(), m_splitDim.end(), [&](unsigned int d) { return d < m_dim; }) &&
+               std::all_of(m_order.begin(), m_order.end(), [&](unsigned int row) { return row < data.size(); });
+    }
+
+    template <typename selector>
+    struct Query {
+        const data_type* test;
+        selector& top;
+        double* offsets;
+        simd::DistanceFunc<data_type> distance;
+    };
+
+    void buildNode(const DataSet<data_type>& data, unsigned int node, unsigned int level, unsigned int first, unsigned int last) {
+        const unsigned int leaves = 1u << m_depth;
+        if (level == m_depth) {
+            m_leafBegin[node - (leaves - 1)] = first;
+            return;
+        }
+
+        // widest dimension of the rows of this node.
+        unsigned int splitDim = 0;
+        double widest = -1;
+        for (unsigned int d = 0; d < m_dim; ++d) {
+            double low = 0, high = 0;
+            for (unsigned int i = first; i < last; ++i) {
+                const double value = static_cast<double>(data.row(m_order[i])[d]);
+                if (i == first || value < low)
+                    low = value;
+                if (i == first || value > high)
+                    high = value;
+            }
+            if (high - low > widest) {
+                widest = high - low;
+                splitDim = d;
+            }
+        }
+
+        const unsigned int middle = first + (last - first) / 2;
+        if (first < last) {
+            std::nth_element(m_order.begin() + first, m_order.begin() + middle, m_order.begin() + last,
+                             [&](unsigned int a, unsigned int b) { return data.row(a)[splitDim] < data.row(b)[splitDim]; });
+        }
+        m_splitDim[node] = splitDim;
+        m_splitValue[node] = middle < last ? static_cast<double>(data.row(m_order[middle])[splitDim]) : 0.0;
+
+        buildNode(data, 2 * node + 1, level + 1, first, middle);
+        buildNode(data, 2 * node + 2, level + 1, middle, last);
+    }
+
+    /**
+	 * Visited the nearer child first, then the farther one only if its cell, at squared
+	 * distance `cellDistance` from the query, may still hold a better candidate.
+	 */
+    template <typename selector>
+    void searchNode(Query<selector>& query, unsigned int node, unsigned int level, double cellDistance) const {
+        if (level == m_depth) {
+            const unsigned int leaf = node - ((1u << m_depth) - 1);
+            for (unsigned int i = m_leafBegin[leaf]; i < m_leafBegin[leaf + 1]; ++i)
+                query.top.push(query.distance(m_points.data() + static_cast<std::size_t>(i) * m_dim, query.test, m_dim), m_order[i]);
+            return;
+        }
+
+        const unsigned int d = m_splitDim[node];
+        const double diff = static_cast<double>(query.test[d]) - m_splitValue[node];
+        const unsigned int nearChild = diff < 0 ? 2 * node + 1 : 2 * node + 2;
+        const unsigned int farChild = diff < 0 ? 2 * node + 2 : 2 * node + 1;
+
+        searchNode(query, nearChild, level + 1, cellDistance);
+
+        const double offset = query.offsets[d];
+        const double farDistance = cellDistance - offset * offset + diff * diff;
+        if (farDistance < query.top.threshold()) {
+            query.offsets[d] = diff;
+            searchNode(query, farChild, level + 1, farDistance);
+            query.offsets[d] = offset;
+        }
+    }
+
+    KdTreeParams m_params;
+    unsigned int m_dim = 0;
+    unsigned int m_depth = 0;
+    std::vector<unsigned int> m_splitDim;   /* Per inner node. */
+    std::vector<double> m_splitValue;       /* Per inner node. */
+    std::vector<unsigned int> m_leafBegin;  /* Per leaf, into `m_order`, plus the end. */
+    std::vector<unsigned int> m_order;      /* Training row of every tree-ordered row. */
+    stdVectorData m_points;                 /* Rows in tree order. */
+};
+} // namespace KNN
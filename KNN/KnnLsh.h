@@ -0,0 +1,375 @@
+//
+// KnnLsh.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnLsh.h> header.
+// Locality-sensitive hashing (LSH) index for <Knn.h>: `tables` hash tables, each keyed by `hashes` random
+// projections of a row, so that near rows tend to share buckets. A query probes its own bucket and the
+// `probes` next most likely ones of every table (multi-probe), then ranks the rows found by exact distance.
+// Rows are hashed one at a time, so the index grows by insertion without any rebuild.
+//
+// Datar M, Immorlica N, Indyk P, et al. Locality-sensitive hashing scheme based on p-stable distributions[C]. SoCG, 2004.
+// Charikar M S. Similarity estimation techniques from rounding algorithms[C]. STOC, 2002.
+// Lv Q, Josephson W, Wang Z, et al. Multi-probe LSH: efficient indexing for high-dimensional similarity search[C]. VLDB, 2007.
+//
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "KnnBase.h"
+#include "KnnSimd.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+template <typename data_type>
+class Lsh;
+
+////////////////////////////////////////////////////////////////
+// Hash families of the LSH index.
+enum class LshFamily {
+    Euclidean, /* p-stable: floor((a·x + b) / w), with Gaussian `a`. */
+    Cosine,    /* Signed random projections: sign(a·x), for direction-normalized data. */
+};
+
+////////////////////////////////////////////////////////////////
+// Parameters of the LSH index.
+struct LshParams {
+    LshFamily family = LshFamily::Euclidean;
+    unsigned int tables = 8;  /* Hash tables. */
+    unsigned int hashes = 8;  /* Projections per table key, at most 32. */
+    unsigned int probes = 16; /* Extra buckets probed per table. */
+    double bucketWidth = 0;   /* `w` of the Euclidean family, 0 to estimate it from the data. */
+    unsigned int seed = 100;  /* Seed of the projections. */
+
+    template <typename data_type>
+    using index = Lsh<data_type>;
+};
+
+////////////////////////////////////////////////////////////////
+// LSH index.
+template <typename data_type>
+class Lsh : public Index<data_type> {
+    using Bucket = std::vector<unsigned int>;
+    using Table = std::unordered_map<std::uint64_t, Bucket>;
+
+    static constexpr unsigned int MAX_HASHES = 32; /* So that the moves of a probe fit a 64-bit mask. */
+
+    ////////////////////////////////////////////////////////////////
+    // Moving hash `coord` of a key by `delta`, at a probability cost of `cost` (smaller is likelier).
+    struct Perturbation {
+        double cost;
+        unsigned int coord;
+        int delta;
+    };
+
+public:
+    explicit Lsh(const LshParams& params = LshParams()) : m_params(params) {
+        m_params.tables = std::max(1u, m_params.tables);
+        m_params.hashes = std::max(1u, std::min(m_params.hashes, MAX_HASHES));
+    }
+
+    /**
+	 * Drew the projections and inserted every row.
+	 */
+    void build(const DataSet<data_type>& data) override {
+        m_data = &data;
+        m_dim = data.dim();
+        m_distance = simd::squaredL2<data_type>();
+
+        const unsigned int count = m_params.tables * m_params.hashes;
+        std::mt19937 random(m_params.seed);
+        std::normal_distribution<double> gaussian;
+        m_projections.resize(static_cast<std::size_t>(count) * m_dim);
+        for (double& value : m_projections)
+            value = gaussian(random);
+
+        m_width = m_params.bucketWidth > 0 ? m_params.bucketWidth : estimateWidth(data, random);
+        std::uniform_real_distribution<double> uniform(0.0, m_width);
+        m_offsets.resize(count);
+        for (double& value : m_offsets)
+            value = m_params.family == LshFamily::Euclidean ? uniform(random) : 0.0;
+
+        m_tables.assign(m_params.tables, Table());
+        m_size = 0;
+        for (unsigned int i = 0; i < data.size(); ++i)
+            insert(i);
+    }
+
+    /**
+	 * Hashed row `row` of the training set into every table. `build` inserts all the rows;
+	 * a row appended to the training set later can be inserted on its own.
+	 */
+    void insert(unsigned int row) {
+        std::vector<double> projected(m_params.hashes);
+        std::vector<std::int64_t> key(m_params.hashes);
+        for (unsigned int t = 0; t < m_params.tables; ++t) {
+            project(m_data->row(row), t, projected.data());
+            hash(projected.data(), key.data());
+            m_tables[t][combine(key.data())].push_back(row);
+        }
+        ++m_size;
+    }
+
+    bool insert(const DataSet<data_type>& data, unsigned int row) override {
+        if (&data != m_data || row != m_size)
+            return false;
+        insert(row);
+        return true;
+    }
+
+    unsigned int search(const data_type* test, unsigned int K, Neighbor* out) const override {
+        if (m_size == 0)
+            return 0;
+
+        VisitedSet& visited = VisitedSet::local();
+        visited.reset(m_data->size());
+        std::vector<double> projected(m_params.hashes);
+        std::vector<std::int64_t> key(m_params.hashes);
+        std::vector<std::int64_t> probeKey(m_params.hashes);
+        std::vector<Perturbation> perturbations;
+        std::vector<std::uint64_t> probes;
+
+        return withTopK(K, [&](auto top) {
+            auto scanBucket = [&](unsigned int t, const std::int64_t* bucketKey) {
+                const auto found = m_tables[t].find(combine(bucketKey));
+                if (found == m_tables[t].end())
+                    return;
+                for (unsigned int row : found->second)
+                    if (visited.visit(row))
+                        top.push(m_distance(m_data->row(row), test, m_dim), row);
+            };
+
+            for (unsigned int t = 0; t < m_params.tables; ++t) {
+                project(test, t, projected.data());
+                hash(projected.data(), key.data());
+                scanBucket(t, key.data());
+                if (!m_params.probes)
+                    continue;
+
+                perturb(projected.data(), key.data(), perturbations);
+                probeSequence(perturbations, m_params.probes, probes);
+                for (std::uint64_t probe : probes) {
+                    std::copy(key.begin(), key.end(), probeKey.begin());
+                    for (; probe; probe &= probe - 1) {
+                        const Perturbation& change = perturbations[tzcnt(probe)];
+                        probeKey[change.coord] = m_params.family == LshFamily::Euclidean ? probeKey[change.coord] + change.delta
+                                                                                            : 1 - probeKey[change.coord];
+                    }
+                    scanBucket(t, probeKey.data());
+                }
+            }
+            return top.copyTo(out);
+        });
+    }
+
+    /**
+	 * Every table is saved flat: its keys, where the bucket of each key begins, and the rows of
+	 * all its buckets.
+	 */
+    void save(ArchiveWriter& out) const override {
+        out.tag("Lsh");
+        out.value(m_params);
+        out.value(m_dim);
+        out.value(m_size);
+        out.value(m_width);
+        out.vector(m_projections);
+        out.vector(m_offsets);
+        for (const Table& table : m_tables) {
+            std::vector<std::uint64_t> keys;
+            std::vector<std::uint64_t> begin(1, 0);
+            std::vector<unsigned int> rows;
+            keys.reserve(table.size());
+            begin.reserve(table.size() + 1);
+            for (const auto& bucket : table) {
+                keys.push_back(bucket.first);
+                rows.insert(rows.end(), bucket.second.begin(), bucket.second.end());
+                begin.push_back(rows.size());
+            }
+            out.vector(keys);
+            out.vector(begin);
+            out.vector(rows);
+        }
+    }
+
+    bool load(ArchiveReader& in, const DataSet<data_type>& data) override {
+        if (!(in.tag("Lsh") && in.value(m_params) && in.value(m_dim) && in.value(m_size) && in.value(m_width) && in.vector(m_projections) &&
+              in.vector(m_offsets)) ||
+            m_dim != data.dim() || m_size > data.size() || m_params.tables == 0 || m_params.hashes == 0 || m_params.hashes > MAX_HASHES ||
+            !(m_width > 0) || m_offsets.size() != static_cast<std::size_t>(m_params.tables) * m_params.hashes ||
+            m_projections.size() != m_offsets.size() * m_dim)
+            return false;
+        m_tables.assign(m_params.tables, Table());
+        for (Table& table : m_tables) {
+            const std::uint64_t *keys = nullptr, *begin = nullptr;
+            const unsigned int* rows = nullptr;
+            std::size_t keyCount = 0, beginCount = 0, rowCount = 0;
+            if (!(in.array(keys, keyCount) && in.array(begin, beginCount) && in.array(rows, rowCount)) || beginCount != keyCount + 1)
+                return false;
+            table.reserve(keyCount);
+            for (std::size_t k = 0; k < keyCount; ++k) {
+                if (begin[k] > begin[k + 1] || begin[k + 1] > rowCount ||
+                    std::any_of(rows + begin[k], rows + begin[k + 1], [&](unsigned int row) { return row >= m_size; }))
+                    return false;
+                table[keys[k]].assign(rows + begin[k], rows + begin[k + 1]);
+            }
+        }
+        m_data = &data;
+        m_distance = simd::squaredL2<data_type>();
+        return true;
+    }
+
+private:
+    /**
+	 * `w` for the Euclidean family: twice the typical nearest neighbor distance,
+	 * estimated on a sample of the rows.
+	 */
+    double estimateWidth(const DataSet<data_type>& data, std::mt19937& random) const {
+        const unsigned int size = data.size();
+        const unsigned int queries = std::min(size, 64u);
+        const unsigned int pool = std::min(size, 4096u);
+        std::uniform_int_distribution<unsigned int> pick(0, size - 1);
+        std::vector<unsigned int> rows(pool);
+        for (unsigned int& row : rows)
+            row = pick(random);
+
+        std::vector<double> nearest;
+        for (unsigned int q = 0; q < queries; ++q) {
+            const unsigned int query = pick(random);
+            double best = std::numeric_limits<double>::infinity();
+            for (unsigned int row : rows) {
+                const double d = m_distance(data.row(row), data.row(query), m_dim);
+                if (row != query && d > 0 && d < best)
+                    best = d;
+            }
+            if (best < std::numeric_limits<double>::infinity())
+                nearest.push_back(best);
+        }
+        if (nearest.empty())
+            return 1.0;
+        std::nth_element(nearest.begin(), nearest.begin() + nearest.size() / 2, nearest.end());
+        return 2.0 * std::sqrt(nearest[nearest.size() / 2]);
+    }
+
+    /**
+	 * The `hashes` projections a·x + b of `row` for table `t`.
+	 */
+    void project(const data_type* row, unsigned int t, double* out) const {
+        for (unsigned int h = 0; h < m_params.hashes; ++h) {
+            const unsigned int j = t * m_params.hashes + h;
+            const double* a = m_projections.data() + static_cast<std::size_t>(j) * m_dim;
+            double sum = m_offsets[j];
+            for (unsigned int d = 0; d < m_dim; ++d)
+                sum += a[d] * static_cast<double>(row[d]);
+            out[h] = sum;
+        }
+    }
+
+    void hash(const double* projected, std::int64_t* key) const {
+        for (unsigned int h = 0; h < m_params.hashes; ++h) {
+            key[h] = m_params.family == LshFamily::Euclidean ? static_cast<std::int64_t>(std::floor(projected[h] / m_width))
+                                                              : (projected[h] >= 0 ? 1 : 0);
+        }
+    }
+
+    std::uint64_t combine(const std::int64_t* key) const {
+        std::uint64_t result = 0x9e3779b97f4a7c15ull;
+        for (unsigned int h = 0; h < m_params.hashes; ++h) {
+            result ^= static_cast<std::uint64_t>(key[h]) + 0x9e3779b97f4a7c15ull + (result << 6) + (result >> 2);
+            result *= 0xff51afd7ed558ccdull;
+        }
+        return result;
+    }
+
+    /**
+	 * Every single-hash move of the query key, sorted by cost: for the Euclidean family,
+	 * the squared distance to the crossed bucket boundary; for the cosine family, the
+	 * squared margin of the flipped sign.
+	 */
+    void perturb(const double* projected, const std::int64_t* key, std::vector<Perturbation>& out) const {
+        out.clear();
+        for (unsigned int h = 0; h < m_params.hashes; ++h) {
+            if (m_params.family == LshFamily::Euclidean) {
+                const double position = projected[h] / m_width - static_cast<double>(key[h]);
+                out.push_back(Perturbation{position * position, h, -1});
+                out.push_back(Perturbation{(1 - position) * (1 - position), h, +1});
+            } else {
+                out.push_back(Perturbation{projected[h] * projected[h], h, 0});
+            }
+        }
+        std::sort(out.begin(), out.end(), [](const Perturbation& a, const Perturbation& b) { return a.cost < b.cost; });
+    }
+
+    /**
+	 * The `count` cheapest sets of moves touching each hash at most once, cheapest first,
+	 * generated with the shift / expand heap of Lv et al. A set is a bit mask over `perturbations`.
+	 */
+    static void probeSequence(const std::vector<Perturbation>& perturbations, unsigned int count, std::vector<std::uint64_t>& out) {
+        using Set = std::pair<double, std::uint64_t>;
+        std::priority_queue<Set, std::vector<Set>, std::greater<Set>> heap;
+
+        out.clear();
+        const unsigned int size = static_cast<unsigned int>(perturbations.size());
+        if (size == 0)
+            return;
+        heap.push(Set(perturbations[0].cost, 1));
+        while (out.size() < count && !heap.empty()) {
+            const Set set = heap.top();
+            heap.pop();
+            const unsigned int last = 63 - lzcnt(set.second);
+            if (last + 1 < size) {
+                const std::uint64_t next = std::uint64_t(1) << (last + 1);
+                heap.push(Set(set.first + perturbations[last + 1].cost - perturbations[last].cost, (set.second ^ (next >> 1)) | next));
+                heap.push(Set(set.first + perturbations[last + 1].cost, set.second | next));
+            }
+
+            std::uint64_t coords = 0;
+            bool valid = true;
+            for (std::uint64_t bits = set.second; bits && valid; bits &= bits - 1) {
+                const std::uint64_t coord = std::uint64_t(1) << perturbations[tzcnt(bits)].coord;
+                valid = !(coords & coord);
+                coords |= coord;
+            }
+            if (valid)
+                out.push_back(set.second);
+        }
+    }
+
+    static unsigned int lzcnt(std::uint64_t value) {
+        unsigned int count = 0;
+        for (std::uint64_t bit = std::uint64_t(1) << 63; !(value & bit); bit >>= 1)
+            ++count;
+        return count;
+    }
+
+    static unsigned int tzcnt(std::uint64_t value) {
+        unsigned int count = 0;
+        for (; !(value & 1); value >>= 1)
+            ++count;
+        return count;
+    }
+
+    LshParams m_params;
+    const DataSet<data_type>* m_data = nullptr;
+    unsigned int m_dim = 0;
+    unsigned int m_size = 0;
+    double m_width = 1.0;
+    simd::DistanceFunc<data_type> m_distance = nullptr;
+    std::vector<double> m_projections; /* `tables * hashes` Gaussian vectors of `dim` values. */
+    std::vector<double> m_offsets;     /* `b` of every projection. */
+    std::vector<Table> m_tables;
+};
+} // namespace KNN
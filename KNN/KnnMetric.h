@@ -0,0 +1,266 @@
+//
+// KnnMetric.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnMetric.h> header.
+// Distances of <Knn.h>, given as its `metric` template parameter, and of the indexes working in any metric
+// space (e.g. <KnnVpTree.h>).
+// A metric is a function object `double operator()(const data_type* a, const data_type* b, unsigned int dim) const`;
+// the metric-space indexes need it to be symmetric, zero only between equal rows, and to satisfy the triangle
+// inequality. The classifier scans with `rank<data_type>()`, a (SIMD-dispatched) kernel ordering rows like the
+// distance itself, e.g. the squared distance for `Euclidean`. The metric-space indexes call `bind<data_type>()`
+// once per build or query, a callable computing the distance with its kernel already selected (see `bindMetric`).
+//
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "KnnSimd.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+////////////////////////////////////////////////////////////////
+// Euclidean (L2) distance, the default one.
+struct Euclidean {
+    template <typename data_type>
+    double operator()(const data_type* a, const data_type* b, unsigned int dim) const {
+        return bind<data_type>()(a, b, dim);
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> rank() {
+        return simd::squaredL2<data_type>();
+    }
+
+    template <typename data_type>
+    static auto bind() {
+        return [kernel = rank<data_type>()](const data_type* a, const data_type* b, unsigned int dim) {
+            return std::sqrt(kernel(a, b, dim));
+        };
+    }
+};
+
+////////////////////////////////////////////////////////////////
+// Squared Euclidean distance: the same neighbors as `Euclidean`, without the root (not a metric).
+struct SquaredEuclidean {
+    template <typename data_type>
+    double operator()(const data_type* a, const data_type* b, unsigned int dim) const {
+        return rank<data_type>()(a, b, dim);
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> rank() {
+        return simd::squaredL2<data_type>();
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> bind() {
+        return rank<data_type>();
+    }
+};
+
+////////////////////////////////////////////////////////////////
+// Manhattan (L1) distance.
+struct Manhattan {
+    template <typename data_type>
+    double operator()(const data_type* a, const data_type* b, unsigned int dim) const {
+        return rank<data_type>()(a, b, dim);
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> rank() {
+        return simd::manhattan<data_type>();
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> bind() {
+        return rank<data_type>();
+    }
+};
+
+////////////////////////////////////////////////////////////////
+// Chebyshev (L∞) distance: the largest coordinate difference.
+struct Chebyshev {
+    template <typename data_type>
+    double operator()(const data_type* a, const data_type* b, unsigned int dim) const {
+        return rank<data_type>()(a, b, dim);
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> rank() {
+        return simd::chebyshev<data_type>();
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> bind() {
+        return rank<data_type>();
+    }
+};
+
+////////////////////////////////////////////////////////////////
+// Minkowski (Lp) distance, ranked by the sum of the p-th powers. `p` is a compile-time constant,
+// so the powers unroll into multiplications (vectorized, see `simd::powerSum`).
+template <unsigned int p>
+struct Minkowski {
+    static_assert(p >= 1, "Minkowski distances need p >= 1");
+
+    template <typename data_type>
+    double operator()(const data_type* a, const data_type* b, unsigned int dim) const {
+        return bind<data_type>()(a, b, dim);
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> rank() {
+        return simd::powerSum<p, data_type>();
+    }
+
+    template <typename data_type>
+    static auto bind() {
+        return [kernel = rank<data_type>()](const data_type* a, const data_type* b, unsigned int dim) {
+            return std::pow(kernel(a, b, dim), 1.0 / p);
+        };
+    }
+};
+
+////////////////////////////////////////////////////////////////
+// Cosine distance, 1 - cos(a, b) (not a metric). A zero row is at distance 1 from everything.
+struct Cosine {
+    template <typename data_type>
+    double operator()(const data_type* a, const data_type* b, unsigned int dim) const {
+        return rank<data_type>()(a, b, dim);
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> rank() {
+        return simd::cosine<data_type>();
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> bind() {
+        return rank<data_type>();
+    }
+};
+
+////////////////////////////////////////////////////////////////
+// Negated inner product (not a metric): the nearest rows are those of the largest a·b
+// (maximum inner product search).
+struct InnerProduct {
+    template <typename data_type>
+    double operator()(const data_type* a, const data_type* b, unsigned int dim) const {
+        return rank<data_type>()(a, b, dim);
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> rank() {
+        return simd::negatedDot<data_type>();
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> bind() {
+        return rank<data_type>();
+    }
+};
+
+////////////////////////////////////////////////////////////////
+// Hamming distance: the number of coordinates that differ.
+struct Hamming {
+    template <typename data_type>
+    double operator()(const data_type* a, const data_type* b, unsigned int dim) const {
+        return rank<data_type>()(a, b, dim);
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> rank() {
+        return simd::hamming<data_type>();
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> bind() {
+        return rank<data_type>();
+    }
+};
+
+////////////////////////////////////////////////////////////////
+// Edit (Levenshtein) distance: the fewest insertions, deletions and substitutions turning one row into
+// the other. A row is read as a string of symbols ending at its first `0`, or after `dim` symbols.
+struct Levenshtein {
+    template <typename data_type>
+    double operator()(const data_type* a, const data_type* b, unsigned int dim) const {
+        return distance(a, b, dim);
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> rank() {
+        return &distance<data_type>;
+    }
+
+    template <typename data_type>
+    static simd::DistanceFunc<data_type> bind() {
+        return &distance<data_type>;
+    }
+
+private:
+    template <typename data_type>
+    static double distance(const data_type* a, const data_type* b, std::size_t dim) {
+        const std::size_t m = length(a, dim);
+        const std::size_t n = length(b, dim);
+        thread_local std::vector<unsigned int> costs;
+        costs.resize(n + 1);
+        for (std::size_t j = 0; j <= n; ++j)
+            costs[j] = static_cast<unsigned int>(j);
+        for (std::size_t i = 1; i <= m; ++i) {
+            unsigned int diagonal = costs[0];
+            costs[0] = static_cast<unsigned int>(i);
+            for (std::size_t j = 1; j <= n; ++j) {
+                const unsigned int above = costs[j];
+                costs[j] = std::min({above + 1, costs[j - 1] + 1, diagonal + (a[i - 1] == b[j - 1] ? 0u : 1u)});
+                diagonal = above;
+            }
+        }
+        return costs[n];
+    }
+
+    template <typename data_type>
+    static std::size_t length(const data_type* row, std::size_t dim) {
+        std::size_t result = 0;
+        while (result < dim && row[result] != data_type())
+            ++result;
+        return result;
+    }
+};
+
+template <typename metric, typename data_type, typename = void>
+struct HasBind : std::false_type {};
+
+template <typename metric, typename data_type>
+struct HasBind<metric, data_type, std::void_t<decltype(std::declval<const metric&>().template bind<data_type>())>> : std::true_type {};
+
+/**
+ * The distance of `distance` as a callable over `data_type` rows: its `bind<data_type>()` when it has
+ * one, with the kernel selected once, and a reference to the metric object otherwise (so `distance`
+ * must outlive it).
+ */
+template <typename data_type, typename metric>
+auto bindMetric(const metric& distance) {
+    if constexpr (HasBind<metric, data_type>::value)
+        return distance.template bind<data_type>();
+    else
+        return [&distance](const data_type* a, const data_type* b, unsigned int dim) { return distance(a, b, dim); };
+}
+
+/**
+ * Whether `metric` ranks rows by squared Euclidean distance, as the Euclidean indexes and the
+ * matrix-product batches of <Knn.h> do.
+ */
+template <typename metric>
+constexpr bool isEuclidean = std::is_same<metric, Euclidean>::value || std::is_same<metric, SquaredEuclidean>::value;
+} // namespace KNN
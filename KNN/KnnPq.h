@@ -0,0 +1,223 @@
+//
+// KnnPq.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnPq.h> header.
+// Product quantization (PQ) index for <Knn.h>: every row is cut into `M` sub-vectors, each replaced by the
+// byte code of its nearest centroid in a 256-entry codebook of its subspace, so a row takes `M` bytes.
+// A query builds one table of distances to all the centroids of every subspace, and the distance to a row
+// is then `M` table lookups (asymmetric distance computation). The best candidates may be re-ranked with
+// exact distances; without re-ranking the classifier releases the raw training set.
+//
+// Jegou H, Douze M, Schmid C. Product quantization for nearest neighbor search[J]. IEEE TPAMI, 2011.
+//
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "KnnBase.h"
+#include "KnnIvf.h"
+#include "KnnSimd.h"
+#include "KnnThreadPool.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+template <typename data_type>
+class Pq;
+
+////////////////////////////////////////////////////////////////
+// Parameters of the PQ index.
+struct PqParams {
+    unsigned int M = 8;              /* Sub-quantizers, i.e. bytes per row. */
+    unsigned int rerank = 0;         /* Candidates re-ranked with exact distances, 0 to drop the raw data. */
+    unsigned int iterations = 10;    /* k-means iterations per codebook. */
+    unsigned int trainSize = 65536;  /* Rows the codebooks are trained on. */
+    unsigned int threads = 0;        /* Build threads, 0 for all the cores. */
+    unsigned int seed = 100;         /* Seed of the training sample. */
+
+    template <typename data_type>
+    using index = Pq<data_type>;
+};
+
+////////////////////////////////////////////////////////////////
+// PQ index.
+template <typename data_type>
+class Pq : public Index<data_type> {
+    static constexpr unsigned int KSUB = 256; /* Centroids per codebook, one byte per code. */
+
+public:
+    explicit Pq(const PqParams& params = PqParams()) : m_params(params) {}
+
+    /**
+	 * Trained one codebook per subspace on a random sample, then encoded every row.
+	 */
+    void build(const DataSet<data_type>& data) override {
+        m_data = &data;
+        m_dim = data.dim();
+        m_size = data.size();
+        m_M = std::max(1u, std::min(m_params.M, m_dim));
+        m_ksub = std::min(KSUB, m_size);
+        m_subBegin.resize(m_M + 1);
+        for (unsigned int m = 0; m <= m_M; ++m)
+            m_subBegin[m] = m * m_dim / m_M;
+
+        unsigned int threads = m_params.threads ? m_params.threads : std::thread::hardware_concurrency();
+        std::unique_ptr<ThreadPool> pool(threads > 1 ? new ThreadPool(threads) : nullptr);
+
+        std::mt19937 random(m_params.seed);
+        std::vector<unsigned int> samples(m_size);
+        std::iota(samples.begin(), samples.end(), 0u);
+        const unsigned int sampleCount = std::max(m_ksub, std::min(m_size, m_params.trainSize));
+        for (unsigned int i = 0; i < sampleCount; ++i)
+            std::swap(samples[i], samples[i + random() % (m_size - i)]);
+        samples.resize(sampleCount);
+
+        m_codebooks.assign(m_M, KMeans<float>());
+        for (unsigned int m = 0; m < m_M; ++m) {
+            const unsigned int dsub = m_subBegin[m + 1] - m_subBegin[m];
+            std::vector<float> sub(static_cast<std::size_t>(sampleCount) * dsub);
+            for (unsigned int i = 0; i < sampleCount; ++i)
+                toFloat(data.row(samples[i]) + m_subBegin[m], dsub, sub.data() + static_cast<std::size_t>(i) * dsub);
+            DataSet<float> subSet;
+            subSet.assign(sub.data(), dsub, sampleCount);
+            std::vector<unsigned int> order(sampleCount);
+            std::iota(order.begin(), order.end(), 0u);
+            m_codebooks[m].train(subSet, order, m_ksub, m_params.iterations, random, pool.get());
+        }
+
+        m_codes.resize(static_cast<std::size_t>(m_size) * m_M);
+        KMeans<float>::forEach(pool.get(), m_size, [&](unsigned int i) {
+            std::vector<float> row(m_dim);
+            toFloat(data.row(i), m_dim, row.data());
+            std::uint8_t* code = m_codes.data() + static_cast<std::size_t>(i) * m_M;
+            for (unsigned int m = 0; m < m_M; ++m)
+                code[m] = static_cast<std::uint8_t>(m_codebooks[m].nearest(row.data() + m_subBegin[m]));
+        });
+    }
+
+    /**
+	 * Scanned the codes through per-query distance tables, then re-ranked the `rerank` best
+	 * candidates with exact distances if asked to. Without re-ranking the distances are the
+	 * (approximate) quantized ones.
+	 */
+    unsigned int search(const data_type* test, unsigned int K, Neighbor* out) const override {
+        if (m_size == 0)
+            return 0;
+
+        // table[m * m_ksub + c]: squared distance between sub-vector `m` of `test` and centroid `c`.
+        std::vector<float> query(m_dim);
+        toFloat(test, m_dim, query.data());
+        std::vector<float> table(static_cast<std::size_t>(m_M) * m_ksub);
+        for (unsigned int m = 0; m < m_M; ++m) {
+            std::vector<double> distances(m_ksub);
+            m_codebooks[m].distances(query.data() + m_subBegin[m], distances.data());
+            std::copy(distances.begin(), distances.end(), table.data() + static_cast<std::size_t>(m) * m_ksub);
+        }
+
+        const unsigned int candidates = m_params.rerank ? std::max(K, m_params.rerank) : K;
+        return withTopK(candidates, [&](auto top) {
+            for (unsigned int i = 0; i < m_size; ++i)
+                top.push(adc(table.data(), m_codes.data() + static_cast<std::size_t>(i) * m_M), i);
+            if (!m_params.rerank)
+                return top.copyTo(out);
+
+            const auto squaredL2 = simd::squaredL2<data_type>();
+            return withTopK(K, [&](auto exact) {
+                for (unsigned int i = 0; i < top.size(); ++i)
+                    exact.push(squaredL2(m_data->row(top.data()[i].index), test, m_dim), top.data()[i].index);
+                return exact.copyTo(out);
+            });
+        });
+    }
+
+    /**
+	 * The raw training set is only read back to re-rank.
+	 */
+    bool needsData() const override {
+        return m_params.rerank > 0;
+    }
+
+    void save(ArchiveWriter& out) const override {
+        out.tag("Pq");
+        out.value(m_params);
+        out.value(m_dim);
+        out.value(m_size);
+        out.value(m_M);
+        out.value(m_ksub);
+        out.vector(m_subBegin);
+        for (const KMeans<float>& codebook : m_codebooks)
+            codebook.save(out);
+        out.vector(m_codes);
+    }
+
+    bool load(ArchiveReader& in, const DataSet<data_type>& data) override {
+        if (!(in.tag("Pq") && in.value(m_params) && in.value(m_dim) && in.value(m_size) && in.value(m_M) && in.value(m_ksub) &&
+              in.vector(m_subBegin)) ||
+            m_dim != data.dim() || m_M == 0 || m_M > m_dim || m_ksub > KSUB || m_subBegin.size() != m_M + std::size_t(1))
+            return false;
+        m_codebooks.assign(m_M, KMeans<float>());
+        for (KMeans<float>& codebook : m_codebooks)
+            if (!codebook.load(in))
+                return false;
+        m_data = &data;
+        return in.vector(m_codes) && consistent(data);
+    }
+
+private:
+    /**
+	 * Whether the subspaces of a loaded index split the dimensions in order, every codebook has
+	 * `ksub` centroids of its subspace, and every code names one of them.
+	 */
+    bool consistent(const DataSet<data_type>& data) const {
+        if (m_subBegin.front() != 0 || m_subBegin.back() != m_dim || m_codes.size() != static_cast<std::size_t>(m_size) * m_M ||
+            (needsData() && m_size > data.size()))
+            return false;
+        for (unsigned int m = 0; m < m_M; ++m)
+            if (m_subBegin[m] >= m_subBegin[m + 1] || m_codebooks[m].dim() != m_subBegin[m + 1] - m_subBegin[m] ||
+                m_codebooks[m].count() != m_ksub)
+                return false;
+        return std::all_of(m_codes.begin(), m_codes.end(), [&](std::uint8_t code) { return code < m_ksub; });
+    }
+
+    /**
+	 * Asymmetric distance: sum of the table entries picked by the codes of a row.
+	 */
+    float adc(const float* table, const std::uint8_t* code) const {
+        float result0 = 0, result1 = 0;
+        unsigned int m = 0;
+        for (; m + 2 <= m_M; m += 2) {
+            result0 += table[m * m_ksub + code[m]];
+            result1 += table[(m + 1) * m_ksub + code[m + 1]];
+        }
+        if (m < m_M)
+            result0 += table[m * m_ksub + code[m]];
+        return result0 + result1;
+    }
+
+    static void toFloat(const data_type* values, unsigned int count, float* out) {
+        for (unsigned int i = 0; i < count; ++i)
+            out[i] = static_cast<float>(values[i]);
+    }
+
+    PqParams m_params;
+    const DataSet<data_type>* m_data = nullptr;
+    unsigned int m_dim = 0;
+    unsigned int m_size = 0;
+    unsigned int m_M = 0;
+    unsigned int m_ksub = 0;
+    std::vector<unsigned int> m_subBegin;    /* First dimension of every subspace, plus the end. */
+    std::vector<KMeans<float>> m_codebooks;  /* One per subspace. */
+    std::vector<std::uint8_t> m_codes;       /* `M` codes per row. */
+};
+} // namespace KNN
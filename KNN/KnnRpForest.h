@@ -0,0 +1,463 @@
+//
+// KnnRpForest.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnRpForest.h> header.
+// Random-projection forest index for <Knn.h> (as in Annoy): every tree splits its rows by the hyperplane
+// halfway between two random rows, down to leaves of `leafSize` rows. A query walks all the trees at once,
+// always expanding the node whose hyperplane is farthest on the wrong side (best first), until `searchK`
+// candidates were collected, then ranks them by exact distance.
+// The whole index, rows included, is one flat block without pointers, saved as is to a file; processes
+// mapping the same file share it read-only, and loading it costs no parsing.
+//
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "KnnBase.h"
+#include "KnnFile.h"
+#include "KnnSimd.h"
+#include "KnnThreadPool.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+template <typename data_type>
+class RpForest;
+
+////////////////////////////////////////////////////////////////
+// Parameters of the random-projection forest index.
+struct RpForestParams {
+    unsigned int trees = 16;    /* Trees; more is slower to build and more exact. */
+    unsigned int leafSize = 32; /* Maximum rows per leaf. */
+    unsigned int searchK = 0;   /* Candidates ranked by a query, 0 for `16 * trees * K`. */
+    std::string path;           /* Index file: mapped if it holds an index over the same rows, else built and
+                                   saved there. Empty to keep the index in memory. */
+    unsigned int threads = 0;   /* Build threads, 0 for all the cores. */
+    unsigned int seed = 100;    /* Seed of the splits. */
+
+    template <typename data_type>
+    using index = RpForest<data_type>;
+};
+
+////////////////////////////////////////////////////////////////
+// Random-projection forest index.
+template <typename data_type>
+class RpForest : public Index<data_type> {
+    using stdVectorByte = std::vector<char, AlignedAllocator<char>>;
+
+    static constexpr std::uint32_t LEAF = 0xffffffffu; /* `plane` of a leaf node. */
+    static constexpr std::size_t ALIGNMENT = 64;        /* Of every section of the flat block. */
+
+    ////////////////////////////////////////////////////////////////
+    // Inner node: children `left` (below the plane) and `right`, plane `plane`, `offset` added to the
+    // projection. Leaf: `plane` is `LEAF`, and its rows are `items[left, left + right)`.
+    struct Node {
+        std::uint32_t left;
+        std::uint32_t right;
+        std::uint32_t plane;
+        float offset;
+    };
+
+    ////////////////////////////////////////////////////////////////
+    // Start of the flat block; sections are given as byte offsets from it.
+    struct Header {
+        char magic[8];
+        std::uint32_t dataSize;  /* sizeof(data_type). */
+        std::uint32_t dataFloat; /* Whether data_type is a floating point type. */
+        std::uint32_t dim;
+        std::uint32_t size;
+        std::uint32_t trees;
+        std::uint32_t nodes;
+        std::uint32_t planes;
+        std::uint32_t reserved;
+        std::uint64_t roots;      /* `trees` root nodes. */
+        std::uint64_t nodeBegin;  /* `nodes` Node. */
+        std::uint64_t planeBegin; /* `planes * dim` float. */
+        std::uint64_t itemBegin;  /* `trees * size` rows, by leaf. */
+        std::uint64_t pointBegin; /* `size * dim` data_type, the training set. */
+        std::uint64_t fileSize;
+    };
+
+    ////////////////////////////////////////////////////////////////
+    // One tree while it is built, with indexes local to it.
+    struct Tree {
+        std::vector<Node> nodes;
+        std::vector<float> planes;
+        std::vector<std::uint32_t> items;
+        std::uint32_t root = 0;
+    };
+
+public:
+    explicit RpForest(const RpForestParams& params = RpForestParams()) : m_params(params) {
+        m_params.trees = std::max(1u, m_params.trees);
+        m_params.leafSize = std::max(1u, m_params.leafSize);
+    }
+
+    /**
+	 * Mapped `path` if it holds a forest over the very same rows (compared with the copy the file
+	 * keeps, as the training set changes under `Knn::add`, `remove` and `compact`), else grew the
+	 * trees and, if there is a `path`, saved them there and mapped the file. The rows are copied into
+	 * the index, so the classifier can free its own.
+	 */
+    void build(const DataSet<data_type>& data) override {
+        if (!m_params.path.empty() && load(m_params.path) && holds(data))
+            return;
+
+        grow(data);
+        if (!m_params.path.empty() && save(m_params.path)) {
+            stdVectorByte buffer;
+            buffer.swap(m_buffer);
+            if (!load(m_params.path)) {
+                m_buffer.swap(buffer);
+                attach(m_buffer.data());
+            }
+        }
+    }
+
+    unsigned int search(const data_type* test, unsigned int K, Neighbor* out) const override {
+        if (!m_header || m_header->size == 0)
+            return 0;
+
+        const std::uint32_t dim = m_header->dim;
+        const unsigned int searchK = m_params.searchK ? m_params.searchK : 16 * m_header->trees * K;
+        const auto squaredL2 = simd::squaredL2<data_type>();
+        VisitedSet& visited = VisitedSet::local();
+        visited.reset(m_header->size);
+
+        // best first over all the trees: (priority, node), the priority being the smallest margin
+        // by which the query lies on the side of every hyperplane on the way.
+        using Entry = std::pair<float, std::uint32_t>;
+        std::priority_queue<Entry> queue;
+        for (std::uint32_t t = 0; t < m_header->trees; ++t)
+            queue.push(Entry(std::numeric_limits<float>::infinity(), m_roots[t]));
+
+        return withTopK(K, [&](auto top) {
+            unsigned int collected = 0;
+            while (collected < searchK && !queue.empty()) {
+                const Entry entry = queue.top();
+                queue.pop();
+                const Node& node = m_nodes[entry.second];
+                if (node.plane == LEAF) {
+                    for (std::uint32_t i = node.left; i < node.left + node.right; ++i) {
+                        const std::uint32_t row = m_items[i];
+                        if (visited.visit(row))
+                            top.push(squaredL2(point(row), test, dim), row);
+                    }
+                    collected += node.right;
+                    continue;
+                }
+                const float margin = project(m_planes + static_cast<std::size_t>(node.plane) * dim, test, dim) + node.offset;
+                queue.push(Entry(std::min(entry.first, margin), node.right));
+                queue.push(Entry(std::min(entry.first, -margin), node.left));
+            }
+            return top.copyTo(out);
+        });
+    }
+
+    /**
+	 * The rows are stored in the index.
+	 */
+    bool needsData() const override {
+        return false;
+    }
+
+    /**
+	 * Wrote the index to `path`, as the flat block it is in memory. Returned whether it worked.
+	 */
+    bool save(const std::string& path) const {
+        if (!m_header)
+            return false;
+        return writeFile(path, reinterpret_cast<const char*>(m_header), static_cast<std::size_t>(m_header->fileSize));
+    }
+
+    /**
+	 * Mapped the index saved to `path` in place of this one, and returned whether it worked.
+	 * Nothing is checked but the file layout, the row type and that the trees stay in bounds.
+	 */
+    bool load(const std::string& path) {
+        std::unique_ptr<MappedFile> file(new MappedFile());
+        if (!file->open(path) || !valid(file->data(), file->size()))
+            return false;
+        m_file = std::move(file);
+        stdVectorByte().swap(m_buffer);
+        attach(m_file->data());
+        return true;
+    }
+
+    /**
+	 * Changed the candidates ranked by the next queries. Not thread-safe: call it between queries.
+	 */
+    void setSearchK(unsigned int searchK) {
+        m_params.searchK = searchK;
+    }
+
+    /**
+	 * The flat block is saved as one array. It is read back in place when the archive lies in a
+	 * mapped file (e.g. by `Knn::load`), which the index then shares, else copied out of it.
+	 */
+    void save(ArchiveWriter& out) const override {
+        out.tag("RpForest");
+        out.value(m_params.trees);
+        out.value(m_params.leafSize);
+        out.value(m_params.searchK);
+        const char* block = reinterpret_cast<const char*>(m_header);
+        out.array(block, m_header ? static_cast<std::size_t>(m_header->fileSize) : 0);
+    }
+
+    bool load(ArchiveReader& in, const DataSet<data_type>& data) override {
+        const char* block = nullptr;
+        std::size_t size = 0;
+        if (!(in.tag("RpForest") && in.value(m_params.trees) && in.value(m_params.leafSize) && in.value(m_params.searchK) &&
+              in.array(block, size)) || !valid(block, size) || reinterpret_cast<const Header*>(block)->dim != data.dim())
+            return false;
+        if (in.file()) {
+            m_file = in.file();
+            stdVectorByte().swap(m_buffer);
+            attach(block);
+        } else {
+            m_buffer.assign(block, block + size);
+            m_file.reset();
+            attach(m_buffer.data());
+        }
+        return true;
+    }
+
+private:
+    /**
+	 * Whether the index was built over the rows of `data`, as they are now.
+	 */
+    bool holds(const DataSet<data_type>& data) const {
+        if (m_header->dim != data.dim() || m_header->size != data.size())
+            return false;
+        const std::size_t bytes = sizeof(data_type) * data.dim();
+        for (std::uint32_t i = 0; i < m_header->size; ++i)
+            if (std::memcmp(point(i), data.row(i), bytes) != 0)
+                return false;
+        return true;
+    }
+
+    /**
+	 * Grew the trees (in parallel) into a new flat block in memory.
+	 */
+    void grow(const DataSet<data_type>& data) {
+        const std::uint32_t dim = data.dim();
+        const std::uint32_t size = data.size();
+        std::vector<Tree> trees(m_params.trees);
+
+        unsigned int threads = m_params.threads ? m_params.threads : std::thread::hardware_concurrency();
+        threads = std::min(threads, m_params.trees);
+        std::unique_ptr<ThreadPool> pool(threads > 1 ? new ThreadPool(threads) : nullptr);
+        auto growTree = [&](unsigned int t) {
+            std::mt19937 random(m_params.seed + t);
+            std::vector<std::uint32_t> rows(size);
+            for (std::uint32_t i = 0; i < size; ++i)
+                rows[i] = i;
+            trees[t].root = split(data, trees[t], rows.data(), size, random);
+        };
+        if (pool)
+            pool->run(m_params.trees, growTree);
+        else
+            for (unsigned int t = 0; t < m_params.trees; ++t)
+                growTree(t);
+
+        // section offsets, then one copy of every tree with its indexes shifted into the block.
+        Header header = Header();
+        std::memcpy(header.magic, "KNNRPF\0\1", 8);
+        header.dataSize = sizeof(data_type);
+        header.dataFloat = std::is_floating_point<data_type>::value;
+        header.dim = dim;
+        header.size = size;
+        header.trees = m_params.trees;
+        for (const Tree& tree : trees) {
+            header.nodes += static_cast<std::uint32_t>(tree.nodes.size());
+            header.planes += static_cast<std::uint32_t>(tree.planes.size() / std::max(1u, dim));
+        }
+        header.roots = align(sizeof(Header));
+        header.nodeBegin = align(header.roots + sizeof(std::uint32_t) * header.trees);
+        header.planeBegin = align(header.nodeBegin + sizeof(Node) * header.nodes);
+        header.itemBegin = align(header.planeBegin + sizeof(float) * header.planes * dim);
+        header.pointBegin = align(header.itemBegin + sizeof(std::uint32_t) * header.trees * size);
+        header.fileSize = align(header.pointBegin + sizeof(data_type) * static_cast<std::uint64_t>(size) * dim);
+
+        m_file.reset();
+        m_buffer.assign(static_cast<std::size_t>(header.fileSize), 0);
+        char* block = m_buffer.data();
+        std::memcpy(block, &header, sizeof(Header));
+        std::uint32_t* roots = reinterpret_cast<std::uint32_t*>(block + header.roots);
+        Node* nodes = reinterpret_cast<Node*>(block + header.nodeBegin);
+        float* planes = reinterpret_cast<float*>(block + header.planeBegin);
+        std::uint32_t* items = reinterpret_cast<std::uint32_t*>(block + header.itemBegin);
+        std::uint32_t nodeBase = 0, planeBase = 0, itemBase = 0;
+        for (const Tree& tree : trees) {
+            roots[&tree - trees.data()] = nodeBase + tree.root;
+            for (Node node : tree.nodes) {
+                if (node.plane == LEAF) {
+                    node.left += itemBase;
+                } else {
+                    node.left += nodeBase;
+                    node.right += nodeBase;
+                    node.plane += planeBase;
+                }
+                *nodes++ = node;
+            }
+            planes = std::copy(tree.planes.begin(), tree.planes.end(), planes);
+            items = std::copy(tree.items.begin(), tree.items.end(), items);
+            nodeBase += static_cast<std::uint32_t>(tree.nodes.size());
+            planeBase += static_cast<std::uint32_t>(tree.planes.size() / std::max(1u, dim));
+            itemBase += static_cast<std::uint32_t>(tree.items.size());
+        }
+        data_type* points = reinterpret_cast<data_type*>(block + header.pointBegin);
+        for (std::uint32_t i = 0; i < size; ++i)
+            std::copy(data.row(i), data.row(i) + dim, points + static_cast<std::size_t>(i) * dim);
+
+        attach(m_buffer.data());
+    }
+
+    /**
+	 * Split `rows[0, count)` by the hyperplane halfway between two random rows (retried a few times if
+	 * that leaves a side nearly empty, then split in halves), and returned the new node.
+	 */
+    std::uint32_t split(const DataSet<data_type>& data, Tree& tree, std::uint32_t* rows, std::uint32_t count, std::mt19937& random) const {
+        const std::uint32_t node = static_cast<std::uint32_t>(tree.nodes.size());
+        tree.nodes.push_back(Node{0, 0, LEAF, 0.0f});
+        if (count <= m_params.leafSize) {
+            tree.nodes[node].left = static_cast<std::uint32_t>(tree.items.size());
+            tree.nodes[node].right = count;
+            tree.items.insert(tree.items.end(), rows, rows + count);
+            return node;
+        }
+
+        const unsigned int dim = data.dim();
+        const std::uint32_t plane = static_cast<std::uint32_t>(tree.planes.size() / dim);
+        tree.planes.resize(tree.planes.size() + dim);
+        std::vector<float> normal(dim);
+        float offset = 0;
+        std::uint32_t* middle = rows + count / 2;
+        std::uniform_int_distribution<std::uint32_t> pick(0, count - 1);
+        for (unsigned int attempt = 0; attempt < 3; ++attempt) {
+            const data_type* a = data.row(rows[pick(random)]);
+            const data_type* b = data.row(rows[pick(random)]);
+            // unit normal, so that margins compare across nodes.
+            double norm = 0, shift = 0;
+            for (unsigned int d = 0; d < dim; ++d) {
+                const double difference = static_cast<double>(a[d]) - static_cast<double>(b[d]);
+                norm += difference * difference;
+                shift -= difference * (static_cast<double>(a[d]) + static_cast<double>(b[d])) / 2;
+            }
+            if (norm == 0)
+                continue;
+            norm = std::sqrt(norm);
+            for (unsigned int d = 0; d < dim; ++d)
+                normal[d] = static_cast<float>((static_cast<double>(a[d]) - static_cast<double>(b[d])) / norm);
+            offset = static_cast<float>(shift / norm);
+            std::uint32_t* partition = std::partition(rows, rows + count, [&](std::uint32_t row) {
+                return project(normal.data(), data.row(row), dim) + offset < 0;
+            });
+            const std::uint32_t below = static_cast<std::uint32_t>(partition - rows);
+            if (below >= count / 16 + 1 && count - below >= count / 16 + 1) {
+                middle = partition;
+                std::copy(normal.begin(), normal.end(), tree.planes.begin() + static_cast<std::size_t>(plane) * dim);
+                tree.nodes[node].offset = offset;
+                break;
+            }
+        }
+
+        tree.nodes[node].plane = plane;
+        const std::uint32_t below = static_cast<std::uint32_t>(middle - rows);
+        const std::uint32_t left = split(data, tree, rows, below, random);
+        const std::uint32_t right = split(data, tree, middle, count - below, random);
+        tree.nodes[node].left = left;
+        tree.nodes[node].right = right;
+        return node;
+    }
+
+    /**
+	 * Whether `block` holds a forest over rows of this type, with its sections in bounds, and its
+	 * nodes, planes and rows too (every child after its parent, so that no search loops).
+	 */
+    static bool valid(const char* block, std::size_t size) {
+        if (size < sizeof(Header))
+            return false;
+        const Header* header = reinterpret_cast<const Header*>(block);
+        if (std::memcmp(header->magic, "KNNRPF\0\1", 8) != 0 || header->dataSize != sizeof(data_type) ||
+            header->dataFloat != static_cast<std::uint32_t>(std::is_floating_point<data_type>::value) || header->fileSize > size)
+            return false;
+        if (!(header->roots + sizeof(std::uint32_t) * header->trees <= header->nodeBegin &&
+              header->nodeBegin + sizeof(Node) * header->nodes <= header->planeBegin &&
+              header->planeBegin + sizeof(float) * header->planes * header->dim <= header->itemBegin &&
+              header->itemBegin + sizeof(std::uint32_t) * header->trees * header->size <= header->pointBegin &&
+              header->pointBegin + sizeof(data_type) * static_cast<std::uint64_t>(header->size) * header->dim <= header->fileSize))
+            return false;
+
+        const std::uint32_t* roots = reinterpret_cast<const std::uint32_t*>(block + header->roots);
+        const Node* nodes = reinterpret_cast<const Node*>(block + header->nodeBegin);
+        const std::uint32_t* items = reinterpret_cast<const std::uint32_t*>(block + header->itemBegin);
+        const std::uint64_t itemCount = static_cast<std::uint64_t>(header->trees) * header->size;
+        if (!std::all_of(roots, roots + header->trees, [&](std::uint32_t root) { return root < header->nodes; }) ||
+            !std::all_of(items, items + itemCount, [&](std::uint32_t row) { return row < header->size; }))
+            return false;
+        for (std::uint32_t node = 0; node < header->nodes; ++node) {
+            const Node& n = nodes[node];
+            if (n.plane == LEAF ? static_cast<std::uint64_t>(n.left) + n.right > itemCount
+                                : n.plane >= header->planes || n.left <= node || n.left >= header->nodes || n.right <= node ||
+                                      n.right >= header->nodes)
+                return false;
+        }
+        return true;
+    }
+
+    /**
+	 * Pointed the sections at the flat block `block`.
+	 */
+    void attach(const char* block) {
+        m_header = reinterpret_cast<const Header*>(block);
+        m_roots = reinterpret_cast<const std::uint32_t*>(block + m_header->roots);
+        m_nodes = reinterpret_cast<const Node*>(block + m_header->nodeBegin);
+        m_planes = reinterpret_cast<const float*>(block + m_header->planeBegin);
+        m_items = reinterpret_cast<const std::uint32_t*>(block + m_header->itemBegin);
+        m_points = reinterpret_cast<const data_type*>(block + m_header->pointBegin);
+    }
+
+    const data_type* point(std::uint32_t row) const {
+        return m_points + static_cast<std::size_t>(row) * m_header->dim;
+    }
+
+    static float project(const float* plane, const data_type* row, unsigned int dim) {
+        float sum = 0;
+        for (unsigned int d = 0; d < dim; ++d)
+            sum += plane[d] * static_cast<float>(row[d]);
+        return sum;
+    }
+
+    static std::uint64_t align(std::uint64_t offset) {
+        return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+
+    RpForestParams m_params;
+    stdVectorByte m_buffer;             /* The flat block, when it is not mapped. */
+    std::shared_ptr<const MappedFile> m_file; /* The file the flat block is mapped from: its own, or a model file. */
+    const Header* m_header = nullptr;
+    const std::uint32_t* m_roots = nullptr;
+    const Node* m_nodes = nullptr;
+    const float* m_planes = nullptr;
+    const std::uint32_t* m_items = nullptr;
+    const data_type* m_points = nullptr;
+};
+} // namespace KNN
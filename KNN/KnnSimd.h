@@ -0,0 +1,1479 @@
+//
+// KnnSimd.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnSimd.h> header.
+// Distance kernels used by <Knn.h>: squared Euclidean, Manhattan (L1), Chebyshev (L∞), the dot product, the
+// cosine distance (the dot product and both norms, in one pass), the Hamming distance and the Minkowski (Lp)
+// power sums.
+// Integer data is differenced and summed in 64-bit integers, so it is stored as it is (`Accumulator`).
+// Every kernel exists as a scalar reference and as SSE4.1 / AVX2 / AVX-512 variants; the variant is picked
+// once at runtime from CPUID, so a single binary runs at full speed on every x86-64 machine of a mixed fleet.
+//
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define KNN_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// GCC and Clang only emit instructions of the enabled target, so every kernel states its ISA.
+// MSVC lets any intrinsic through and does not need (nor know) the attribute.
+#if defined(KNN_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define KNN_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KNN_TARGET(isa)
+#endif
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN::simd`
+// In general, it should not be used or modified externally.
+namespace KNN {
+namespace simd {
+
+////////////////////////////////////////////////////////////////
+// Instruction set levels, ordered from the weakest to the strongest.
+enum class Level : int {
+    Scalar = 0,
+    SSE = 1,    /* SSE4.1 */
+    AVX2 = 2,   /* AVX2 + FMA */
+    AVX512 = 3, /* AVX-512F */
+};
+
+////////////////////////////////////////////////////////////////
+// Features reported by CPUID (and enabled by the OS through XCR0).
+struct CpuFeatures {
+    bool sse41 = false;
+    bool popcnt = false;
+    bool avx = false;
+    bool f16c = false;
+    bool avx2 = false;
+    bool fma = false;
+    bool avx512f = false;
+    bool avx512bw = false;
+    bool avx512vnni = false;
+    bool avx512bf16 = false;
+    bool avx512vpopcntdq = false;
+};
+
+#ifdef KNN_SIMD_X86
+inline void cpuid(unsigned int leaf, unsigned int subleaf, unsigned int reg[4]) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuidex(info, static_cast<int>(leaf), static_cast<int>(subleaf));
+    for (int i = 0; i < 4; ++i)
+        reg[i] = static_cast<unsigned int>(info[i]);
+#else
+    __cpuid_count(leaf, subleaf, reg[0], reg[1], reg[2], reg[3]);
+#endif
+}
+
+inline std::uint64_t xgetbv() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<std::uint64_t>(edx) << 32) | eax;
+#endif
+}
+#endif
+
+/**
+ * Queried once, then cached.
+ */
+inline const CpuFeatures& cpu() {
+    static const CpuFeatures features = [] {
+        CpuFeatures f;
+#ifdef KNN_SIMD_X86
+        unsigned int reg[4];
+        cpuid(0, 0, reg);
+        const unsigned int maxLeaf = reg[0];
+        if (maxLeaf < 1)
+            return f;
+
+        cpuid(1, 0, reg);
+        f.sse41 = (reg[2] >> 19) & 1;
+        f.popcnt = (reg[2] >> 23) & 1;
+        const bool osxsave = (reg[2] >> 27) & 1;
+        const bool fma = (reg[2] >> 12) & 1;
+        const bool avx = (reg[2] >> 28) & 1;
+        const std::uint64_t xcr0 = osxsave ? xgetbv() : 0;
+        const bool ymmState = (xcr0 & 0x6) == 0x6;
+        const bool zmmState = (xcr0 & 0xe6) == 0xe6;
+        f.avx = avx && ymmState;
+        f.fma = fma && f.avx;
+        f.f16c = ((reg[2] >> 29) & 1) && f.avx;
+
+        if (maxLeaf >= 7) {
+            cpuid(7, 0, reg);
+            f.avx2 = ((reg[1] >> 5) & 1) && f.avx;
+            f.avx512f = ((reg[1] >> 16) & 1) && zmmState;
+            f.avx512bw = ((reg[1] >> 30) & 1) && f.avx512f;
+            f.avx512vnni = ((reg[2] >> 11) & 1) && f.avx512f;
+            f.avx512vpopcntdq = ((reg[2] >> 14) & 1) && f.avx512f;
+            if (reg[0] >= 1) {
+                cpuid(7, 1, reg);
+                f.avx512bf16 = ((reg[0] >> 5) & 1) && f.avx512f;
+            }
+        }
+#endif
+        return f;
+    }();
+    return features;
+}
+
+/**
+ * Strongest level supported by this machine.
+ */
+inline Level detect() {
+    const CpuFeatures& f = cpu();
+    if (f.avx512f)
+        return Level::AVX512;
+    if (f.avx2 && f.fma)
+        return Level::AVX2;
+    if (f.sse41)
+        return Level::SSE;
+    return Level::Scalar;
+}
+
+////////////////////////////////////////////////////////////////
+// Accumulators of the scalar kernels: integers of up to 32 bits are differenced exactly in 64 bits
+// (`type`), and their squares and absolute differences summed unsigned (`sum`, exact while it fits in
+// 64 bits); everything else goes through double. Integer training sets are thus stored as they are,
+// e.g. `std::uint8_t` image features, without widening the data itself.
+template <typename data_type>
+struct Accumulator {
+    using type = std::conditional_t<std::is_integral<data_type>::value && sizeof(data_type) <= 4, std::int64_t, double>;
+    using sum = std::conditional_t<std::is_integral<type>::value, std::uint64_t, double>;
+};
+
+template <typename data_type>
+using accumulator_t = typename Accumulator<data_type>::type;
+
+////////////////////////////////////////////////////////////////
+// Scalar reference kernels, kept for verification and for types without a SIMD kernel.
+template <typename data_type>
+double squaredL2Scalar(const data_type* a, const data_type* b, std::size_t dim) {
+    using accumulator = accumulator_t<data_type>;
+    using sum = typename Accumulator<data_type>::sum;
+    sum result = 0;
+    for (std::size_t i = 0; i < dim; ++i) {
+        const accumulator diff = static_cast<accumulator>(a[i]) - static_cast<accumulator>(b[i]);
+        result += static_cast<sum>(diff) * static_cast<sum>(diff);
+    }
+    return static_cast<double>(result);
+}
+
+template <typename data_type>
+double manhattanScalar(const data_type* a, const data_type* b, std::size_t dim) {
+    using accumulator = accumulator_t<data_type>;
+    using sum = typename Accumulator<data_type>::sum;
+    sum result = 0;
+    for (std::size_t i = 0; i < dim; ++i) {
+        const accumulator diff = static_cast<accumulator>(a[i]) - static_cast<accumulator>(b[i]);
+        result += static_cast<sum>(diff < 0 ? -diff : diff);
+    }
+    return static_cast<double>(result);
+}
+
+template <typename data_type>
+double chebyshevScalar(const data_type* a, const data_type* b, std::size_t dim) {
+    using accumulator = accumulator_t<data_type>;
+    accumulator result = 0;
+    for (std::size_t i = 0; i < dim; ++i) {
+        const accumulator diff = static_cast<accumulator>(a[i]) - static_cast<accumulator>(b[i]);
+        result = std::max(result, diff < 0 ? -diff : diff);
+    }
+    return static_cast<double>(result);
+}
+
+template <typename data_type>
+double dotScalar(const data_type* a, const data_type* b, std::size_t dim) {
+    using accumulator = accumulator_t<data_type>;
+    accumulator result = 0;
+    for (std::size_t i = 0; i < dim; ++i)
+        result += static_cast<accumulator>(a[i]) * static_cast<accumulator>(b[i]);
+    return static_cast<double>(result);
+}
+
+/**
+ * 1 - a·b / (||a|| ||b||), or 1 if a row is zero.
+ */
+inline double cosineOf(double ab, double aa, double bb) {
+    const double norms = aa * bb;
+    return norms > 0 ? 1 - ab / std::sqrt(norms) : 1;
+}
+
+template <typename data_type>
+double cosineScalar(const data_type* a, const data_type* b, std::size_t dim) {
+    using accumulator = accumulator_t<data_type>;
+    accumulator ab = 0, aa = 0, bb = 0;
+    for (std::size_t i = 0; i < dim; ++i) {
+        const accumulator x = static_cast<accumulator>(a[i]), y = static_cast<accumulator>(b[i]);
+        ab += x * y;
+        aa += x * x;
+        bb += y * y;
+    }
+    return cosineOf(static_cast<double>(ab), static_cast<double>(aa), static_cast<double>(bb));
+}
+
+template <typename data_type>
+double negatedDotScalar(const data_type* a, const data_type* b, std::size_t dim) {
+    return -dotScalar(a, b, dim);
+}
+
+template <typename data_type>
+double hammingScalar(const data_type* a, const data_type* b, std::size_t dim) {
+    std::size_t result = 0;
+    for (std::size_t i = 0; i < dim; ++i)
+        result += a[i] != b[i];
+    return static_cast<double>(result);
+}
+
+/**
+ * `x` to the power `p`, by repeated squaring.
+ */
+template <unsigned int p>
+inline double powerOf(double x) {
+    if constexpr (p == 1) {
+        return x;
+    } else if constexpr (p % 2) {
+        return x * powerOf<p - 1>(x);
+    } else {
+        const double half = powerOf<p / 2>(x);
+        return half * half;
+    }
+}
+
+template <unsigned int p, typename data_type>
+double powerSumScalar(const data_type* a, const data_type* b, std::size_t dim) {
+    double result = 0;
+    for (std::size_t i = 0; i < dim; ++i)
+        result += powerOf<p>(std::fabs(static_cast<double>(a[i]) - static_cast<double>(b[i])));
+    return result;
+}
+
+#ifdef KNN_SIMD_X86
+
+// GCC 12 reports its own AVX-512 intrinsics as reading uninitialized values (GCC bug 105593).
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+////////////////////////////////////////////////////////////////
+// Horizontal sums.
+KNN_TARGET("sse4.1")
+inline float hsum(__m128 v) {
+    __m128 shuf = _mm_movehdup_ps(v);
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+
+KNN_TARGET("sse4.1")
+inline double hsum(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+KNN_TARGET("sse4.1")
+inline std::int64_t hsum64(__m128i v) {
+    return _mm_cvtsi128_si64(_mm_add_epi64(v, _mm_unpackhi_epi64(v, v)));
+}
+
+KNN_TARGET("avx2,fma")
+inline float hsum(__m256 v) {
+    return hsum(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+KNN_TARGET("avx2,fma")
+inline double hsum(__m256d v) {
+    return hsum(_mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1)));
+}
+
+KNN_TARGET("avx2,fma")
+inline std::int64_t hsum64(__m256i v) {
+    return hsum64(_mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+////////////////////////////////////////////////////////////////
+// Horizontal maxima.
+KNN_TARGET("sse4.1")
+inline float hmax(__m128 v) {
+    v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+    return _mm_cvtss_f32(_mm_max_ss(v, _mm_movehdup_ps(v)));
+}
+
+KNN_TARGET("sse4.1")
+inline double hmax(__m128d v) {
+    return _mm_cvtsd_f64(_mm_max_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+KNN_TARGET("avx2,fma")
+inline float hmax(__m256 v) {
+    return hmax(_mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+KNN_TARGET("avx2,fma")
+inline double hmax(__m256d v) {
+    return hmax(_mm_max_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1)));
+}
+
+////////////////////////////////////////////////////////////////
+// float.
+KNN_TARGET("sse4.1")
+inline double squaredL2SSE(const float* a, const float* b, std::size_t dim) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        const __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        const __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    float result = hsum(_mm_add_ps(acc0, acc1));
+    for (; i < dim; ++i)
+        result += (a[i] - b[i]) * (a[i] - b[i]);
+    return result;
+}
+
+KNN_TARGET("avx2,fma")
+inline double squaredL2AVX2(const float* a, const float* b, std::size_t dim) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        const __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    if (i + 8 <= dim) {
+        const __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        i += 8;
+    }
+    float result = hsum(_mm256_add_ps(acc0, acc1));
+    for (; i < dim; ++i)
+        result += (a[i] - b[i]) * (a[i] - b[i]);
+    return result;
+}
+
+KNN_TARGET("avx512f")
+inline double squaredL2AVX512(const float* a, const float* b, std::size_t dim) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        const __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        const __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i < dim; i += 16) {
+        const __mmask16 mask = dim - i >= 16 ? __mmask16(0xffff) : __mmask16((1u << (dim - i)) - 1);
+        const __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+////////////////////////////////////////////////////////////////
+// double.
+KNN_TARGET("sse4.1")
+inline double squaredL2SSE(const double* a, const double* b, std::size_t dim) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        const __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i));
+        const __m128d d1 = _mm_sub_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2));
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(d0, d0));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(d1, d1));
+    }
+    double result = hsum(_mm_add_pd(acc0, acc1));
+    for (; i < dim; ++i)
+        result += (a[i] - b[i]) * (a[i] - b[i]);
+    return result;
+}
+
+KNN_TARGET("avx2,fma")
+inline double squaredL2AVX2(const double* a, const double* b, std::size_t dim) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        const __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        const __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4));
+        acc0 = _mm256_fmadd_pd(d0, d0, acc0);
+        acc1 = _mm256_fmadd_pd(d1, d1, acc1);
+    }
+    if (i + 4 <= dim) {
+        const __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i));
+        acc0 = _mm256_fmadd_pd(d0, d0, acc0);
+        i += 4;
+    }
+    double result = hsum(_mm256_add_pd(acc0, acc1));
+    for (; i < dim; ++i)
+        result += (a[i] - b[i]) * (a[i] - b[i]);
+    return result;
+}
+
+KNN_TARGET("avx512f")
+inline double squaredL2AVX512(const double* a, const double* b, std::size_t dim) {
+    __m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        const __m512d d0 = _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i));
+        const __m512d d1 = _mm512_sub_pd(_mm512_loadu_pd(a + i + 8), _mm512_loadu_pd(b + i + 8));
+        acc0 = _mm512_fmadd_pd(d0, d0, acc0);
+        acc1 = _mm512_fmadd_pd(d1, d1, acc1);
+    }
+    for (; i < dim; i += 8) {
+        const __mmask8 mask = dim - i >= 8 ? __mmask8(0xff) : __mmask8((1u << (dim - i)) - 1);
+        const __m512d d0 = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i));
+        acc0 = _mm512_fmadd_pd(d0, d0, acc0);
+    }
+    return _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+}
+
+////////////////////////////////////////////////////////////////
+// int: |a - b| = max - min, exact as an unsigned 32-bit value, squared into 64 bits (even and odd lanes
+// separately) and summed unsigned, so no difference wraps.
+KNN_TARGET("sse4.1")
+inline double squaredL2SSE(const int* a, const int* b, std::size_t dim) {
+    __m128i acc = _mm_setzero_si128();
+    std::size_t i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        const __m128i d = _mm_sub_epi32(_mm_max_epi32(x, y), _mm_min_epi32(x, y));
+        acc = _mm_add_epi64(acc, _mm_mul_epu32(d, d));
+        const __m128i odd = _mm_srli_epi64(d, 32);
+        acc = _mm_add_epi64(acc, _mm_mul_epu32(odd, odd));
+    }
+    std::uint64_t result = static_cast<std::uint64_t>(hsum64(acc));
+    for (; i < dim; ++i) {
+        const std::uint64_t diff = static_cast<std::uint64_t>(static_cast<std::int64_t>(a[i]) - b[i]);
+        result += diff * diff;
+    }
+    return static_cast<double>(result);
+}
+
+KNN_TARGET("avx2,fma")
+inline double squaredL2AVX2(const int* a, const int* b, std::size_t dim) {
+    __m256i acc = _mm256_setzero_si256();
+    std::size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        const __m256i d = _mm256_sub_epi32(_mm256_max_epi32(x, y), _mm256_min_epi32(x, y));
+        acc = _mm256_add_epi64(acc, _mm256_mul_epu32(d, d));
+        const __m256i odd = _mm256_srli_epi64(d, 32);
+        acc = _mm256_add_epi64(acc, _mm256_mul_epu32(odd, odd));
+    }
+    std::uint64_t result = static_cast<std::uint64_t>(hsum64(acc));
+    for (; i < dim; ++i) {
+        const std::uint64_t diff = static_cast<std::uint64_t>(static_cast<std::int64_t>(a[i]) - b[i]);
+        result += diff * diff;
+    }
+    return static_cast<double>(result);
+}
+
+KNN_TARGET("avx512f")
+inline double squaredL2AVX512(const int* a, const int* b, std::size_t dim) {
+    __m512i acc = _mm512_setzero_si512();
+    for (std::size_t i = 0; i < dim; i += 16) {
+        const __mmask16 mask = dim - i >= 16 ? __mmask16(0xffff) : __mmask16((1u << (dim - i)) - 1);
+        const __m512i x = _mm512_maskz_loadu_epi32(mask, a + i);
+        const __m512i y = _mm512_maskz_loadu_epi32(mask, b + i);
+        const __m512i d = _mm512_sub_epi32(_mm512_max_epi32(x, y), _mm512_min_epi32(x, y));
+        acc = _mm512_add_epi64(acc, _mm512_mul_epu32(d, d));
+        const __m512i odd = _mm512_srli_epi64(d, 32);
+        acc = _mm512_add_epi64(acc, _mm512_mul_epu32(odd, odd));
+    }
+    return static_cast<double>(static_cast<std::uint64_t>(_mm512_reduce_add_epi64(acc)));
+}
+
+////////////////////////////////////////////////////////////////
+// 8-bit integers: differences widened to 16 bits, squared and added in pairs into 32-bit lanes
+// (`madd`), which are flushed into 64-bit lanes every BYTE_BLOCK values, before they could overflow.
+constexpr std::size_t BYTE_BLOCK = 1 << 16;
+
+template <typename byte>
+KNN_TARGET("sse4.1")
+inline __m128i widenBytes128(__m128i x) {
+    return std::is_signed<byte>::value ? _mm_cvtepi8_epi16(x) : _mm_cvtepu8_epi16(x);
+}
+
+template <typename byte>
+KNN_TARGET("avx2,fma")
+inline __m256i widenBytes256(__m128i x) {
+    return std::is_signed<byte>::value ? _mm256_cvtepi8_epi16(x) : _mm256_cvtepu8_epi16(x);
+}
+
+template <typename byte>
+KNN_TARGET("avx512f,avx512bw")
+inline __m512i widenBytes512(__m256i x) {
+    return std::is_signed<byte>::value ? _mm512_cvtepi8_epi16(x) : _mm512_cvtepu8_epi16(x);
+}
+
+template <typename byte>
+KNN_TARGET("sse4.1")
+inline double squaredL2BytesSSE(const byte* a, const byte* b, std::size_t dim) {
+    __m128i total = _mm_setzero_si128();
+    std::size_t i = 0;
+    while (i + 16 <= dim) {
+        const std::size_t end = std::min(dim, i + BYTE_BLOCK);
+        __m128i acc = _mm_setzero_si128();
+        for (; i + 16 <= end; i += 16) {
+            const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+            const __m128i d0 = _mm_sub_epi16(widenBytes128<byte>(x), widenBytes128<byte>(y));
+            const __m128i d1 = _mm_sub_epi16(widenBytes128<byte>(_mm_srli_si128(x, 8)), widenBytes128<byte>(_mm_srli_si128(y, 8)));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(d0, d0));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(d1, d1));
+        }
+        total = _mm_add_epi64(total, _mm_add_epi64(_mm_cvtepu32_epi64(acc), _mm_cvtepu32_epi64(_mm_srli_si128(acc, 8))));
+    }
+    return static_cast<double>(hsum64(total)) + squaredL2Scalar(a + i, b + i, dim - i);
+}
+
+template <typename byte>
+KNN_TARGET("avx2,fma")
+inline double squaredL2BytesAVX2(const byte* a, const byte* b, std::size_t dim) {
+    __m256i total = _mm256_setzero_si256();
+    std::size_t i = 0;
+    while (i + 32 <= dim) {
+        const std::size_t end = std::min(dim, i + BYTE_BLOCK);
+        __m256i acc = _mm256_setzero_si256();
+        for (; i + 32 <= end; i += 32) {
+            const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+            const __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+            const __m256i d0 = _mm256_sub_epi16(widenBytes256<byte>(_mm256_castsi256_si128(x)), widenBytes256<byte>(_mm256_castsi256_si128(y)));
+            const __m256i d1 = _mm256_sub_epi16(widenBytes256<byte>(_mm256_extracti128_si256(x, 1)), widenBytes256<byte>(_mm256_extracti128_si256(y, 1)));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d0, d0));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d1, d1));
+        }
+        total = _mm256_add_epi64(total, _mm256_add_epi64(_mm256_cvtepu32_epi64(_mm256_castsi256_si128(acc)),
+                                                         _mm256_cvtepu32_epi64(_mm256_extracti128_si256(acc, 1))));
+    }
+    return static_cast<double>(hsum64(total)) + squaredL2Scalar(a + i, b + i, dim - i);
+}
+
+template <typename byte>
+KNN_TARGET("avx512f,avx512bw")
+inline double squaredL2BytesAVX512(const byte* a, const byte* b, std::size_t dim) {
+    __m512i total = _mm512_setzero_si512();
+    for (std::size_t i = 0; i < dim;) {
+        const std::size_t end = std::min(dim, i + BYTE_BLOCK);
+        __m512i acc = _mm512_setzero_si512();
+        for (; i < end; i += 64) {
+            const __mmask64 mask = end - i >= 64 ? ~__mmask64(0) : (__mmask64(1) << (end - i)) - 1;
+            const __m512i x = _mm512_maskz_loadu_epi8(mask, a + i);
+            const __m512i y = _mm512_maskz_loadu_epi8(mask, b + i);
+            const __m512i d0 = _mm512_sub_epi16(widenBytes512<byte>(_mm512_castsi512_si256(x)), widenBytes512<byte>(_mm512_castsi512_si256(y)));
+            const __m512i d1 = _mm512_sub_epi16(widenBytes512<byte>(_mm512_extracti64x4_epi64(x, 1)), widenBytes512<byte>(_mm512_extracti64x4_epi64(y, 1)));
+            acc = _mm512_add_epi32(acc, _mm512_madd_epi16(d0, d0));
+            acc = _mm512_add_epi32(acc, _mm512_madd_epi16(d1, d1));
+        }
+        total = _mm512_add_epi64(total, _mm512_add_epi64(_mm512_cvtepu32_epi64(_mm512_castsi512_si256(acc)),
+                                                         _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(acc, 1))));
+    }
+    return static_cast<double>(_mm512_reduce_add_epi64(total));
+}
+
+////////////////////////////////////////////////////////////////
+// 16-bit integers: differences widened to 32 bits, squared and summed in 64 bits like int.
+template <typename word>
+KNN_TARGET("sse4.1")
+inline __m128i widenWords128(__m128i x) {
+    return std::is_signed<word>::value ? _mm_cvtepi16_epi32(x) : _mm_cvtepu16_epi32(x);
+}
+
+template <typename word>
+KNN_TARGET("avx2,fma")
+inline __m256i widenWords256(__m128i x) {
+    return std::is_signed<word>::value ? _mm256_cvtepi16_epi32(x) : _mm256_cvtepu16_epi32(x);
+}
+
+template <typename word>
+KNN_TARGET("avx512f")
+inline __m512i widenWords512(__m256i x) {
+    return std::is_signed<word>::value ? _mm512_cvtepi16_epi32(x) : _mm512_cvtepu16_epi32(x);
+}
+
+template <typename word>
+KNN_TARGET("sse4.1")
+inline double squaredL2WordsSSE(const word* a, const word* b, std::size_t dim) {
+    __m128i acc = _mm_setzero_si128();
+    std::size_t i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        const __m128i d = _mm_sub_epi32(widenWords128<word>(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(a + i))),
+                                        widenWords128<word>(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(b + i))));
+        acc = _mm_add_epi64(acc, _mm_mul_epi32(d, d));
+        const __m128i odd = _mm_srli_epi64(d, 32);
+        acc = _mm_add_epi64(acc, _mm_mul_epi32(odd, odd));
+    }
+    return static_cast<double>(hsum64(acc)) + squaredL2Scalar(a + i, b + i, dim - i);
+}
+
+template <typename word>
+KNN_TARGET("avx2,fma")
+inline double squaredL2WordsAVX2(const word* a, const word* b, std::size_t dim) {
+    __m256i acc = _mm256_setzero_si256();
+    std::size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        const __m256i d = _mm256_sub_epi32(widenWords256<word>(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i))),
+                                           widenWords256<word>(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i))));
+        acc = _mm256_add_epi64(acc, _mm256_mul_epi32(d, d));
+        const __m256i odd = _mm256_srli_epi64(d, 32);
+        acc = _mm256_add_epi64(acc, _mm256_mul_epi32(odd, odd));
+    }
+    return static_cast<double>(hsum64(acc)) + squaredL2Scalar(a + i, b + i, dim - i);
+}
+
+template <typename word>
+KNN_TARGET("avx512f")
+inline double squaredL2WordsAVX512(const word* a, const word* b, std::size_t dim) {
+    __m512i acc = _mm512_setzero_si512();
+    std::size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        const __m512i d = _mm512_sub_epi32(widenWords512<word>(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i))),
+                                           widenWords512<word>(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i))));
+        acc = _mm512_add_epi64(acc, _mm512_mul_epi32(d, d));
+        const __m512i odd = _mm512_srli_epi64(d, 32);
+        acc = _mm512_add_epi64(acc, _mm512_mul_epi32(odd, odd));
+    }
+    return static_cast<double>(_mm512_reduce_add_epi64(acc)) + squaredL2Scalar(a + i, b + i, dim - i);
+}
+
+////////////////////////////////////////////////////////////////
+// Manhattan, Chebyshev and dot product, float: absolute values clear the sign bit.
+KNN_TARGET("sse4.1")
+inline double manhattanSSE(const float* a, const float* b, std::size_t dim) {
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i))));
+        acc1 = _mm_add_ps(acc1, _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4))));
+    }
+    float result = hsum(_mm_add_ps(acc0, acc1));
+    for (; i < dim; ++i)
+        result += std::fabs(a[i] - b[i]);
+    return result;
+}
+
+KNN_TARGET("avx2,fma")
+inline double manhattanAVX2(const float* a, const float* b, std::size_t dim) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        acc0 = _mm256_add_ps(acc0, _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i))));
+        acc1 = _mm256_add_ps(acc1, _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8))));
+    }
+    float result = hsum(_mm256_add_ps(acc0, acc1));
+    for (; i < dim; ++i)
+        result += std::fabs(a[i] - b[i]);
+    return result;
+}
+
+KNN_TARGET("avx512f")
+inline double manhattanAVX512(const float* a, const float* b, std::size_t dim) {
+    __m512 acc = _mm512_setzero_ps();
+    for (std::size_t i = 0; i < dim; i += 16) {
+        const __mmask16 mask = dim - i >= 16 ? __mmask16(0xffff) : __mmask16((1u << (dim - i)) - 1);
+        acc = _mm512_add_ps(acc, _mm512_abs_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i))));
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+KNN_TARGET("sse4.1")
+inline double chebyshevSSE(const float* a, const float* b, std::size_t dim) {
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 acc = _mm_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 4 <= dim; i += 4)
+        acc = _mm_max_ps(acc, _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i))));
+    float result = hmax(acc);
+    for (; i < dim; ++i)
+        result = std::fmax(result, std::fabs(a[i] - b[i]));
+    return result;
+}
+
+KNN_TARGET("avx2,fma")
+inline double chebyshevAVX2(const float* a, const float* b, std::size_t dim) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 acc = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 8 <= dim; i += 8)
+        acc = _mm256_max_ps(acc, _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i))));
+    float result = hmax(acc);
+    for (; i < dim; ++i)
+        result = std::fmax(result, std::fabs(a[i] - b[i]));
+    return result;
+}
+
+KNN_TARGET("avx512f")
+inline double chebyshevAVX512(const float* a, const float* b, std::size_t dim) {
+    __m512 acc = _mm512_setzero_ps();
+    for (std::size_t i = 0; i < dim; i += 16) {
+        const __mmask16 mask = dim - i >= 16 ? __mmask16(0xffff) : __mmask16((1u << (dim - i)) - 1);
+        acc = _mm512_max_ps(acc, _mm512_abs_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i))));
+    }
+    return _mm512_reduce_max_ps(acc);
+}
+
+KNN_TARGET("sse4.1")
+inline double dotSSE(const float* a, const float* b, std::size_t dim) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float result = hsum(_mm_add_ps(acc0, acc1));
+    for (; i < dim; ++i)
+        result += a[i] * b[i];
+    return result;
+}
+
+KNN_TARGET("avx2,fma")
+inline double dotAVX2(const float* a, const float* b, std::size_t dim) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    float result = hsum(_mm256_add_ps(acc0, acc1));
+    for (; i < dim; ++i)
+        result += a[i] * b[i];
+    return result;
+}
+
+KNN_TARGET("avx512f")
+inline double dotAVX512(const float* a, const float* b, std::size_t dim) {
+    __m512 acc = _mm512_setzero_ps();
+    for (std::size_t i = 0; i < dim; i += 16) {
+        const __mmask16 mask = dim - i >= 16 ? __mmask16(0xffff) : __mmask16((1u << (dim - i)) - 1);
+        acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), acc);
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+KNN_TARGET("sse4.1")
+inline double cosineSSE(const float* a, const float* b, std::size_t dim) {
+    __m128 ab = _mm_setzero_ps(), aa = _mm_setzero_ps(), bb = _mm_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        const __m128 x = _mm_loadu_ps(a + i), y = _mm_loadu_ps(b + i);
+        ab = _mm_add_ps(ab, _mm_mul_ps(x, y));
+        aa = _mm_add_ps(aa, _mm_mul_ps(x, x));
+        bb = _mm_add_ps(bb, _mm_mul_ps(y, y));
+    }
+    float sab = hsum(ab), saa = hsum(aa), sbb = hsum(bb);
+    for (; i < dim; ++i) {
+        sab += a[i] * b[i];
+        saa += a[i] * a[i];
+        sbb += b[i] * b[i];
+    }
+    return cosineOf(sab, saa, sbb);
+}
+
+KNN_TARGET("avx2,fma")
+inline double cosineAVX2(const float* a, const float* b, std::size_t dim) {
+    __m256 ab = _mm256_setzero_ps(), aa = _mm256_setzero_ps(), bb = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        const __m256 x = _mm256_loadu_ps(a + i), y = _mm256_loadu_ps(b + i);
+        ab = _mm256_fmadd_ps(x, y, ab);
+        aa = _mm256_fmadd_ps(x, x, aa);
+        bb = _mm256_fmadd_ps(y, y, bb);
+    }
+    float sab = hsum(ab), saa = hsum(aa), sbb = hsum(bb);
+    for (; i < dim; ++i) {
+        sab += a[i] * b[i];
+        saa += a[i] * a[i];
+        sbb += b[i] * b[i];
+    }
+    return cosineOf(sab, saa, sbb);
+}
+
+KNN_TARGET("avx512f")
+inline double cosineAVX512(const float* a, const float* b, std::size_t dim) {
+    __m512 ab = _mm512_setzero_ps(), aa = _mm512_setzero_ps(), bb = _mm512_setzero_ps();
+    for (std::size_t i = 0; i < dim; i += 16) {
+        const __mmask16 mask = dim - i >= 16 ? __mmask16(0xffff) : __mmask16((1u << (dim - i)) - 1);
+        const __m512 x = _mm512_maskz_loadu_ps(mask, a + i), y = _mm512_maskz_loadu_ps(mask, b + i);
+        ab = _mm512_fmadd_ps(x, y, ab);
+        aa = _mm512_fmadd_ps(x, x, aa);
+        bb = _mm512_fmadd_ps(y, y, bb);
+    }
+    return cosineOf(_mm512_reduce_add_ps(ab), _mm512_reduce_add_ps(aa), _mm512_reduce_add_ps(bb));
+}
+
+////////////////////////////////////////////////////////////////
+// Manhattan, Chebyshev and dot product, double.
+KNN_TARGET("sse4.1")
+inline double manhattanSSE(const double* a, const double* b, std::size_t dim) {
+    const __m128d sign = _mm_set1_pd(-0.0);
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_andnot_pd(sign, _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i))));
+        acc1 = _mm_add_pd(acc1, _mm_andnot_pd(sign, _mm_sub_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2))));
+    }
+    double result = hsum(_mm_add_pd(acc0, acc1));
+    for (; i < dim; ++i)
+        result += std::fabs(a[i] - b[i]);
+    return result;
+}
+
+KNN_TARGET("avx2,fma")
+inline double manhattanAVX2(const double* a, const double* b, std::size_t dim) {
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i))));
+        acc1 = _mm256_add_pd(acc1, _mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4))));
+    }
+    double result = hsum(_mm256_add_pd(acc0, acc1));
+    for (; i < dim; ++i)
+        result += std::fabs(a[i] - b[i]);
+    return result;
+}
+
+KNN_TARGET("avx512f")
+inline double manhattanAVX512(const double* a, const double* b, std::size_t dim) {
+    __m512d acc = _mm512_setzero_pd();
+    for (std::size_t i = 0; i < dim; i += 8) {
+        const __mmask8 mask = dim - i >= 8 ? __mmask8(0xff) : __mmask8((1u << (dim - i)) - 1);
+        acc = _mm512_add_pd(acc, _mm512_abs_pd(_mm512_sub_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i))));
+    }
+    return _mm512_reduce_add_pd(acc);
+}
+
+KNN_TARGET("sse4.1")
+inline double chebyshevSSE(const double* a, const double* b, std::size_t dim) {
+    const __m128d sign = _mm_set1_pd(-0.0);
+    __m128d acc = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 2 <= dim; i += 2)
+        acc = _mm_max_pd(acc, _mm_andnot_pd(sign, _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i))));
+    double result = hmax(acc);
+    for (; i < dim; ++i)
+        result = std::fmax(result, std::fabs(a[i] - b[i]));
+    return result;
+}
+
+KNN_TARGET("avx2,fma")
+inline double chebyshevAVX2(const double* a, const double* b, std::size_t dim) {
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d acc = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 4 <= dim; i += 4)
+        acc = _mm256_max_pd(acc, _mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i))));
+    double result = hmax(acc);
+    for (; i < dim; ++i)
+        result = std::fmax(result, std::fabs(a[i] - b[i]));
+    return result;
+}
+
+KNN_TARGET("avx512f")
+inline double chebyshevAVX512(const double* a, const double* b, std::size_t dim) {
+    __m512d acc = _mm512_setzero_pd();
+    for (std::size_t i = 0; i < dim; i += 8) {
+        const __mmask8 mask = dim - i >= 8 ? __mmask8(0xff) : __mmask8((1u << (dim - i)) - 1);
+        acc = _mm512_max_pd(acc, _mm512_abs_pd(_mm512_sub_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i))));
+    }
+    return _mm512_reduce_max_pd(acc);
+}
+
+KNN_TARGET("sse4.1")
+inline double dotSSE(const double* a, const double* b, std::size_t dim) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    double result = hsum(_mm_add_pd(acc0, acc1));
+    for (; i < dim; ++i)
+        result += a[i] * b[i];
+    return result;
+}
+
+KNN_TARGET("avx2,fma")
+inline double dotAVX2(const double* a, const double* b, std::size_t dim) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), acc0);
+        acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), acc1);
+    }
+    double result = hsum(_mm256_add_pd(acc0, acc1));
+    for (; i < dim; ++i)
+        result += a[i] * b[i];
+    return result;
+}
+
+KNN_TARGET("avx512f")
+inline double dotAVX512(const double* a, const double* b, std::size_t dim) {
+    __m512d acc = _mm512_setzero_pd();
+    for (std::size_t i = 0; i < dim; i += 8) {
+        const __mmask8 mask = dim - i >= 8 ? __mmask8(0xff) : __mmask8((1u << (dim - i)) - 1);
+        acc = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i), acc);
+    }
+    return _mm512_reduce_add_pd(acc);
+}
+
+KNN_TARGET("sse4.1")
+inline double cosineSSE(const double* a, const double* b, std::size_t dim) {
+    __m128d ab = _mm_setzero_pd(), aa = _mm_setzero_pd(), bb = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 2 <= dim; i += 2) {
+        const __m128d x = _mm_loadu_pd(a + i), y = _mm_loadu_pd(b + i);
+        ab = _mm_add_pd(ab, _mm_mul_pd(x, y));
+        aa = _mm_add_pd(aa, _mm_mul_pd(x, x));
+        bb = _mm_add_pd(bb, _mm_mul_pd(y, y));
+    }
+    double sab = hsum(ab), saa = hsum(aa), sbb = hsum(bb);
+    for (; i < dim; ++i) {
+        sab += a[i] * b[i];
+        saa += a[i] * a[i];
+        sbb += b[i] * b[i];
+    }
+    return cosineOf(sab, saa, sbb);
+}
+
+KNN_TARGET("avx2,fma")
+inline double cosineAVX2(const double* a, const double* b, std::size_t dim) {
+    __m256d ab = _mm256_setzero_pd(), aa = _mm256_setzero_pd(), bb = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        const __m256d x = _mm256_loadu_pd(a + i), y = _mm256_loadu_pd(b + i);
+        ab = _mm256_fmadd_pd(x, y, ab);
+        aa = _mm256_fmadd_pd(x, x, aa);
+        bb = _mm256_fmadd_pd(y, y, bb);
+    }
+    double sab = hsum(ab), saa = hsum(aa), sbb = hsum(bb);
+    for (; i < dim; ++i) {
+        sab += a[i] * b[i];
+        saa += a[i] * a[i];
+        sbb += b[i] * b[i];
+    }
+    return cosineOf(sab, saa, sbb);
+}
+
+KNN_TARGET("avx512f")
+inline double cosineAVX512(const double* a, const double* b, std::size_t dim) {
+    __m512d ab = _mm512_setzero_pd(), aa = _mm512_setzero_pd(), bb = _mm512_setzero_pd();
+    for (std::size_t i = 0; i < dim; i += 8) {
+        const __mmask8 mask = dim - i >= 8 ? __mmask8(0xff) : __mmask8((1u << (dim - i)) - 1);
+        const __m512d x = _mm512_maskz_loadu_pd(mask, a + i), y = _mm512_maskz_loadu_pd(mask, b + i);
+        ab = _mm512_fmadd_pd(x, y, ab);
+        aa = _mm512_fmadd_pd(x, x, aa);
+        bb = _mm512_fmadd_pd(y, y, bb);
+    }
+    return cosineOf(_mm512_reduce_add_pd(ab), _mm512_reduce_add_pd(aa), _mm512_reduce_add_pd(bb));
+}
+
+////////////////////////////////////////////////////////////////
+// Negated dot products, float and double: the ranking of the maximum inner product search.
+template <typename data_type>
+KNN_TARGET("sse4.1")
+inline double negatedDotSSE(const data_type* a, const data_type* b, std::size_t dim) {
+    return -dotSSE(a, b, dim);
+}
+
+template <typename data_type>
+KNN_TARGET("avx2,fma")
+inline double negatedDotAVX2(const data_type* a, const data_type* b, std::size_t dim) {
+    return -dotAVX2(a, b, dim);
+}
+
+template <typename data_type>
+KNN_TARGET("avx512f")
+inline double negatedDotAVX512(const data_type* a, const data_type* b, std::size_t dim) {
+    return -dotAVX512(a, b, dim);
+}
+
+////////////////////////////////////////////////////////////////
+// Hamming distance: the lanes are compared for equality (as values for floating point types, so that
+// -0 equals 0 and NaN equals nothing, as in the scalar kernel), the equal ones counted with `popcnt`
+// from the byte mask (a lane mask for AVX-512), and `dim` minus their count returned.
+template <typename data_type>
+KNN_TARGET("sse4.1,popcnt")
+inline unsigned int equalBytes128(const data_type* a, const data_type* b) {
+    if constexpr (std::is_same<data_type, float>::value) {
+        return static_cast<unsigned int>(_mm_movemask_epi8(_mm_castps_si128(_mm_cmpeq_ps(_mm_loadu_ps(a), _mm_loadu_ps(b)))));
+    } else if constexpr (std::is_same<data_type, double>::value) {
+        return static_cast<unsigned int>(_mm_movemask_epi8(_mm_castpd_si128(_mm_cmpeq_pd(_mm_loadu_pd(a), _mm_loadu_pd(b)))));
+    } else {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+        const __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+        if constexpr (sizeof(data_type) == 1)
+            return static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)));
+        else if constexpr (sizeof(data_type) == 2)
+            return static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi16(x, y)));
+        else
+            return static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi32(x, y)));
+    }
+}
+
+template <typename data_type>
+KNN_TARGET("avx2,fma,popcnt")
+inline unsigned int equalBytes256(const data_type* a, const data_type* b) {
+    if constexpr (std::is_same<data_type, float>::value) {
+        return static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(a), _mm256_loadu_ps(b), _CMP_EQ_OQ))));
+    } else if constexpr (std::is_same<data_type, double>::value) {
+        return static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_castpd_si256(_mm256_cmp_pd(_mm256_loadu_pd(a), _mm256_loadu_pd(b), _CMP_EQ_OQ))));
+    } else {
+        const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+        const __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+        if constexpr (sizeof(data_type) == 1)
+            return static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+        else if constexpr (sizeof(data_type) == 2)
+            return static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi16(x, y)));
+        else
+            return static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_cmpeq_epi32(x, y)));
+    }
+}
+
+/**
+ * Equal lanes among the first `count` (at most one register) of `a` and `b`.
+ */
+template <typename data_type>
+KNN_TARGET("avx512f,avx512bw,popcnt")
+inline std::uint64_t equalLanes512(const data_type* a, const data_type* b, std::size_t count) {
+    const __mmask64 mask = count >= 64 ? ~__mmask64(0) : (__mmask64(1) << count) - 1;
+    if constexpr (std::is_same<data_type, float>::value) {
+        return _mm512_mask_cmp_ps_mask(__mmask16(mask), _mm512_maskz_loadu_ps(__mmask16(mask), a), _mm512_maskz_loadu_ps(__mmask16(mask), b), _CMP_EQ_OQ);
+    } else if constexpr (std::is_same<data_type, double>::value) {
+        return _mm512_mask_cmp_pd_mask(__mmask8(mask), _mm512_maskz_loadu_pd(__mmask8(mask), a), _mm512_maskz_loadu_pd(__mmask8(mask), b), _CMP_EQ_OQ);
+    } else if constexpr (sizeof(data_type) == 1) {
+        return _mm512_mask_cmpeq_epi8_mask(mask, _mm512_maskz_loadu_epi8(mask, a), _mm512_maskz_loadu_epi8(mask, b));
+    } else if constexpr (sizeof(data_type) == 2) {
+        return _mm512_mask_cmpeq_epi16_mask(__mmask32(mask), _mm512_maskz_loadu_epi16(__mmask32(mask), a), _mm512_maskz_loadu_epi16(__mmask32(mask), b));
+    } else {
+        return _mm512_mask_cmpeq_epi32_mask(__mmask16(mask), _mm512_maskz_loadu_epi32(__mmask16(mask), a), _mm512_maskz_loadu_epi32(__mmask16(mask), b));
+    }
+}
+
+template <typename data_type>
+KNN_TARGET("sse4.1,popcnt")
+inline double hammingSSE(const data_type* a, const data_type* b, std::size_t dim) {
+    constexpr std::size_t lanes = 16 / sizeof(data_type);
+    std::size_t equalBytes = 0, i = 0;
+    for (; i + lanes <= dim; i += lanes)
+        equalBytes += static_cast<std::size_t>(_mm_popcnt_u32(equalBytes128(a + i, b + i)));
+    return static_cast<double>(i - equalBytes / sizeof(data_type)) + hammingScalar(a + i, b + i, dim - i);
+}
+
+template <typename data_type>
+KNN_TARGET("avx2,fma,popcnt")
+inline double hammingAVX2(const data_type* a, const data_type* b, std::size_t dim) {
+    constexpr std::size_t lanes = 32 / sizeof(data_type);
+    std::size_t equalBytes = 0, i = 0;
+    for (; i + lanes <= dim; i += lanes)
+        equalBytes += static_cast<std::size_t>(_mm_popcnt_u32(equalBytes256(a + i, b + i)));
+    return static_cast<double>(i - equalBytes / sizeof(data_type)) + hammingScalar(a + i, b + i, dim - i);
+}
+
+template <typename data_type>
+KNN_TARGET("avx512f,avx512bw,popcnt")
+inline double hammingAVX512(const data_type* a, const data_type* b, std::size_t dim) {
+    constexpr std::size_t lanes = 64 / sizeof(data_type);
+    std::size_t equal = 0;
+    for (std::size_t i = 0; i < dim; i += lanes)
+        equal += static_cast<std::size_t>(_mm_popcnt_u64(equalLanes512(a + i, b + i, dim - i)));
+    return static_cast<double>(dim - equal);
+}
+
+////////////////////////////////////////////////////////////////
+// Minkowski power sums, float and double: absolute differences raised to the compile-time `p` by
+// repeated squaring (`power`), and summed. Both in double, as in the scalar kernel: the powers
+// leave the range of float long before the distances do.
+template <unsigned int p>
+KNN_TARGET("sse4.1")
+inline __m128d power(__m128d x) {
+    if constexpr (p == 1) {
+        return x;
+    } else if constexpr (p % 2) {
+        return _mm_mul_pd(x, power<p - 1>(x));
+    } else {
+        const __m128d half = power<p / 2>(x);
+        return _mm_mul_pd(half, half);
+    }
+}
+
+template <unsigned int p>
+KNN_TARGET("avx2,fma")
+inline __m256d power(__m256d x) {
+    if constexpr (p == 1) {
+        return x;
+    } else if constexpr (p % 2) {
+        return _mm256_mul_pd(x, power<p - 1>(x));
+    } else {
+        const __m256d half = power<p / 2>(x);
+        return _mm256_mul_pd(half, half);
+    }
+}
+
+template <unsigned int p>
+KNN_TARGET("avx512f")
+inline __m512d power(__m512d x) {
+    if constexpr (p == 1) {
+        return x;
+    } else if constexpr (p % 2) {
+        return _mm512_mul_pd(x, power<p - 1>(x));
+    } else {
+        const __m512d half = power<p / 2>(x);
+        return _mm512_mul_pd(half, half);
+    }
+}
+
+template <unsigned int p>
+KNN_TARGET("sse4.1")
+inline double powerSumSSE(const float* a, const float* b, std::size_t dim) {
+    const __m128d sign = _mm_set1_pd(-0.0);
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        const __m128 x = _mm_loadu_ps(a + i), y = _mm_loadu_ps(b + i);
+        const __m128d low = _mm_sub_pd(_mm_cvtps_pd(x), _mm_cvtps_pd(y));
+        const __m128d high = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), _mm_cvtps_pd(_mm_movehl_ps(y, y)));
+        acc0 = _mm_add_pd(acc0, power<p>(_mm_andnot_pd(sign, low)));
+        acc1 = _mm_add_pd(acc1, power<p>(_mm_andnot_pd(sign, high)));
+    }
+    return hsum(_mm_add_pd(acc0, acc1)) + powerSumScalar<p>(a + i, b + i, dim - i);
+}
+
+template <unsigned int p>
+KNN_TARGET("avx2,fma")
+inline double powerSumAVX2(const float* a, const float* b, std::size_t dim) {
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        const __m256d d0 = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(a + i)), _mm256_cvtps_pd(_mm_loadu_ps(b + i)));
+        const __m256d d1 = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(a + i + 4)), _mm256_cvtps_pd(_mm_loadu_ps(b + i + 4)));
+        acc0 = _mm256_add_pd(acc0, power<p>(_mm256_andnot_pd(sign, d0)));
+        acc1 = _mm256_add_pd(acc1, power<p>(_mm256_andnot_pd(sign, d1)));
+    }
+    return hsum(_mm256_add_pd(acc0, acc1)) + powerSumScalar<p>(a + i, b + i, dim - i);
+}
+
+template <unsigned int p>
+KNN_TARGET("avx512f")
+inline double powerSumAVX512(const float* a, const float* b, std::size_t dim) {
+    __m512d acc = _mm512_setzero_pd();
+    for (std::size_t i = 0; i < dim; i += 8) {
+        const __mmask16 mask = dim - i >= 8 ? __mmask16(0xff) : __mmask16((1u << (dim - i)) - 1);
+        const __m512d x = _mm512_cvtps_pd(_mm512_castps512_ps256(_mm512_maskz_loadu_ps(mask, a + i)));
+        const __m512d y = _mm512_cvtps_pd(_mm512_castps512_ps256(_mm512_maskz_loadu_ps(mask, b + i)));
+        acc = _mm512_add_pd(acc, power<p>(_mm512_abs_pd(_mm512_sub_pd(x, y))));
+    }
+    return _mm512_reduce_add_pd(acc);
+}
+
+template <unsigned int p>
+KNN_TARGET("sse4.1")
+inline double powerSumSSE(const double* a, const double* b, std::size_t dim) {
+    const __m128d sign = _mm_set1_pd(-0.0);
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 4 <= dim; i += 4) {
+        acc0 = _mm_add_pd(acc0, power<p>(_mm_andnot_pd(sign, _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)))));
+        acc1 = _mm_add_pd(acc1, power<p>(_mm_andnot_pd(sign, _mm_sub_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)))));
+    }
+    return hsum(_mm_add_pd(acc0, acc1)) + powerSumScalar<p>(a + i, b + i, dim - i);
+}
+
+template <unsigned int p>
+KNN_TARGET("avx2,fma")
+inline double powerSumAVX2(const double* a, const double* b, std::size_t dim) {
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        acc0 = _mm256_add_pd(acc0, power<p>(_mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)))));
+        acc1 = _mm256_add_pd(acc1, power<p>(_mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)))));
+    }
+    return hsum(_mm256_add_pd(acc0, acc1)) + powerSumScalar<p>(a + i, b + i, dim - i);
+}
+
+template <unsigned int p>
+KNN_TARGET("avx512f")
+inline double powerSumAVX512(const double* a, const double* b, std::size_t dim) {
+    __m512d acc = _mm512_setzero_pd();
+    for (std::size_t i = 0; i < dim; i += 8) {
+        const __mmask8 mask = dim - i >= 8 ? __mmask8(0xff) : __mmask8((1u << (dim - i)) - 1);
+        const __m512d x = _mm512_maskz_loadu_pd(mask, a + i), y = _mm512_maskz_loadu_pd(mask, b + i);
+        acc = _mm512_add_pd(acc, power<p>(_mm512_abs_pd(_mm512_sub_pd(x, y))));
+    }
+    return _mm512_reduce_add_pd(acc);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // KNN_SIMD_X86
+
+////////////////////////////////////////////////////////////////
+// Runtime dispatch.
+template <typename data_type>
+using DistanceFunc = double (*)(const data_type*, const data_type*, std::size_t);
+
+////////////////////////////////////////////////////////////////
+// The kernels with a dispatched variant.
+enum class Kernel {
+    SquaredL2,
+    Manhattan,
+    Chebyshev,
+    Dot,
+    NegatedDot,
+    Cosine,
+    Hamming,
+};
+
+template <typename data_type>
+DistanceFunc<data_type> scalarKernel(Kernel kernel) {
+    switch (kernel) {
+    case Kernel::Manhattan:
+        return &manhattanScalar<data_type>;
+    case Kernel::Chebyshev:
+        return &chebyshevScalar<data_type>;
+    case Kernel::Dot:
+        return &dotScalar<data_type>;
+    case Kernel::NegatedDot:
+        return &negatedDotScalar<data_type>;
+    case Kernel::Cosine:
+        return &cosineScalar<data_type>;
+    case Kernel::Hamming:
+        return &hammingScalar<data_type>;
+    default:
+        return &squaredL2Scalar<data_type>;
+    }
+}
+
+template <typename data_type>
+struct Kernels {
+    static DistanceFunc<data_type> select(Kernel kernel, Level) {
+        return scalarKernel<data_type>(kernel);
+    }
+};
+
+#ifdef KNN_SIMD_X86
+/**
+ * Hamming distance of any type with a SIMD kernel; `popcnt` comes with every level but SSE4.1,
+ * and AVX-512 compares 8- and 16-bit lanes with AVX-512BW only.
+ */
+template <typename data_type>
+DistanceFunc<data_type> hammingKernel(Level level) {
+    if (!cpu().popcnt)
+        return &hammingScalar<data_type>;
+    if (level == Level::AVX512 && !cpu().avx512bw)
+        level = Level::AVX2;
+    const DistanceFunc<data_type> kernels[] = {&hammingScalar<data_type>, &hammingSSE<data_type>, &hammingAVX2<data_type>,
+                                               &hammingAVX512<data_type>};
+    return kernels[static_cast<int>(level)];
+}
+
+template <typename data_type>
+struct X86Kernels {
+    static DistanceFunc<data_type> select(Kernel kernel, Level level) {
+        if (kernel == Kernel::Hamming)
+            return hammingKernel<data_type>(level);
+        if (kernel != Kernel::SquaredL2)
+            return other(kernel, level);
+        switch (level) {
+        case Level::AVX512:
+            return &squaredL2AVX512;
+        case Level::AVX2:
+            return &squaredL2AVX2;
+        case Level::SSE:
+            return &squaredL2SSE;
+        default:
+            return scalarKernel<data_type>(kernel);
+        }
+    }
+
+private:
+    /**
+	 * Manhattan, Chebyshev, (negated) dot product and cosine, vectorized for floating point types only.
+	 */
+    static DistanceFunc<data_type> other(Kernel kernel, Level level) {
+        if constexpr (std::is_floating_point<data_type>::value) {
+            // indexed by level.
+            const DistanceFunc<data_type> manhattans[] = {&manhattanScalar<data_type>, &manhattanSSE, &manhattanAVX2, &manhattanAVX512};
+            const DistanceFunc<data_type> chebyshevs[] = {&chebyshevScalar<data_type>, &chebyshevSSE, &chebyshevAVX2, &chebyshevAVX512};
+            const DistanceFunc<data_type> dots[] = {&dotScalar<data_type>, &dotSSE, &dotAVX2, &dotAVX512};
+            const DistanceFunc<data_type> negatedDots[] = {&negatedDotScalar<data_type>, &negatedDotSSE<data_type>, &negatedDotAVX2<data_type>,
+                                                           &negatedDotAVX512<data_type>};
+            const DistanceFunc<data_type> cosines[] = {&cosineScalar<data_type>, &cosineSSE, &cosineAVX2, &cosineAVX512};
+            const int i = static_cast<int>(level);
+            switch (kernel) {
+            case Kernel::Manhattan: return manhattans[i];
+            case Kernel::Chebyshev: return chebyshevs[i];
+            case Kernel::Cosine: return cosines[i];
+            case Kernel::NegatedDot: return negatedDots[i];
+            default: return dots[i];
+            }
+        }
+        return scalarKernel<data_type>(kernel);
+    }
+};
+
+template <>
+struct Kernels<float> : X86Kernels<float> {};
+template <>
+struct Kernels<double> : X86Kernels<double> {};
+template <>
+struct Kernels<int> : X86Kernels<int> {};
+
+/**
+ * 8- and 16-bit integers: squared Euclidean distance widened in SIMD, and Hamming distance; the
+ * other kernels scalar.
+ */
+template <typename data_type>
+struct NarrowKernels {
+    static DistanceFunc<data_type> select(Kernel kernel, Level level) {
+        if (kernel == Kernel::Hamming)
+            return hammingKernel<data_type>(level);
+        if (kernel != Kernel::SquaredL2)
+            return scalarKernel<data_type>(kernel);
+        if constexpr (sizeof(data_type) == 1) {
+            if (level == Level::AVX512 && !cpu().avx512bw)
+                level = Level::AVX2;
+            const DistanceFunc<data_type> kernels[] = {&squaredL2Scalar<data_type>, &squaredL2BytesSSE<data_type>, &squaredL2BytesAVX2<data_type>,
+                                                       &squaredL2BytesAVX512<data_type>};
+            return kernels[static_cast<int>(level)];
+        } else {
+            const DistanceFunc<data_type> kernels[] = {&squaredL2Scalar<data_type>, &squaredL2WordsSSE<data_type>, &squaredL2WordsAVX2<data_type>,
+                                                       &squaredL2WordsAVX512<data_type>};
+            return kernels[static_cast<int>(level)];
+        }
+    }
+};
+
+template <>
+struct Kernels<std::int8_t> : NarrowKernels<std::int8_t> {};
+template <>
+struct Kernels<std::uint8_t> : NarrowKernels<std::uint8_t> {};
+template <>
+struct Kernels<std::int16_t> : NarrowKernels<std::int16_t> {};
+template <>
+struct Kernels<std::uint16_t> : NarrowKernels<std::uint16_t> {};
+#endif
+
+/**
+ * Level used by the dispatched kernels, `detect()` unless forced by `setLevel`.
+ */
+inline Level& activeLevel() {
+    static Level level = detect();
+    return level;
+}
+
+/**
+ * Forced the dispatch to `level` (clamped to what the CPU supports), e.g. `Level::Scalar`
+ * to verify results against the reference kernel. Not thread-safe: call it before querying.
+ */
+inline Level setLevel(Level level) {
+    const Level best = detect();
+    activeLevel() = static_cast<int>(level) < static_cast<int>(best) ? level : best;
+    return activeLevel();
+}
+
+/**
+ * Squared Euclidean distance kernel for `data_type` at the active level.
+ * Fetch it once per scan and call it for every row.
+ */
+template <typename data_type>
+DistanceFunc<data_type> squaredL2() {
+    return Kernels<data_type>::select(Kernel::SquaredL2, activeLevel());
+}
+
+/**
+ * Manhattan (L1) distance kernel for `data_type` at the active level.
+ */
+template <typename data_type>
+DistanceFunc<data_type> manhattan() {
+    return Kernels<data_type>::select(Kernel::Manhattan, activeLevel());
+}
+
+/**
+ * Chebyshev (L∞) distance kernel for `data_type` at the active level.
+ */
+template <typename data_type>
+DistanceFunc<data_type> chebyshev() {
+    return Kernels<data_type>::select(Kernel::Chebyshev, activeLevel());
+}
+
+/**
+ * Dot product kernel for `data_type` at the active level.
+ */
+template <typename data_type>
+DistanceFunc<data_type> dot() {
+    return Kernels<data_type>::select(Kernel::Dot, activeLevel());
+}
+
+/**
+ * Negated dot product kernel for `data_type` at the active level, which ranks the largest
+ * inner products first.
+ */
+template <typename data_type>
+DistanceFunc<data_type> negatedDot() {
+    return Kernels<data_type>::select(Kernel::NegatedDot, activeLevel());
+}
+
+/**
+ * Cosine distance kernel for `data_type` at the active level: the dot product and both squared
+ * norms accumulate in one pass over the rows.
+ */
+template <typename data_type>
+DistanceFunc<data_type> cosine() {
+    return Kernels<data_type>::select(Kernel::Cosine, activeLevel());
+}
+
+/**
+ * Hamming distance kernel (the number of coordinates that differ) for `data_type` at the active level.
+ */
+template <typename data_type>
+DistanceFunc<data_type> hamming() {
+    return Kernels<data_type>::select(Kernel::Hamming, activeLevel());
+}
+
+/**
+ * Minkowski power sum kernel (the sum of the `p`-th powers of the absolute differences) for `data_type`
+ * at the active level, vectorized for float and double.
+ */
+template <unsigned int p, typename data_type>
+DistanceFunc<data_type> powerSum() {
+#ifdef KNN_SIMD_X86
+    if constexpr (std::is_same<data_type, float>::value || std::is_same<data_type, double>::value) {
+        // indexed by level.
+        const DistanceFunc<data_type> kernels[] = {&powerSumScalar<p, data_type>, &powerSumSSE<p>, &powerSumAVX2<p>, &powerSumAVX512<p>};
+        return kernels[static_cast<int>(activeLevel())];
+    }
+#endif
+    return &powerSumScalar<p, data_type>;
+}
+
+} // namespace simd
+} // namespace KNN
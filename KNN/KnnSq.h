@@ -0,0 +1,301 @@
+//
+// KnnSq.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnSq.h> header.
+// Scalar quantization (SQ) index for <Knn.h>: every value is stored as one byte, its position between the
+// minimum and the maximum of its dimension over the training set, so the scan reads a quarter of the bytes
+// of a float training set. With c the code of a row, s the step and m the minimum of every dimension,
+//
+//      ||q - (m + s·c)||² = ||q - m||² - 2·Σ s(q - m)·c + ||s·c||²
+//
+// where ||s·c||² is stored per row, and the middle term is an integer dot product between the byte codes
+// and 16-bit weights s(q - m) quantized once per query (SSE4.1 / AVX2 / AVX-512BW, and AVX-512 VNNI).
+// The best candidates may be re-ranked with exact distances; without re-ranking the classifier releases
+// the raw training set.
+//
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "KnnBase.h"
+#include "KnnSimd.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+template <typename data_type>
+class Sq;
+
+////////////////////////////////////////////////////////////////
+// Parameters of the SQ index.
+struct SqParams {
+    unsigned int rerank = 0; /* Candidates re-ranked with exact distances, 0 to drop the raw data. */
+
+    template <typename data_type>
+    using index = Sq<data_type>;
+};
+
+////////////////////////////////////////////////////////////////
+// Dot products between byte codes and 16-bit weights, `dim` a multiple of 64.
+namespace sq {
+
+using DotFunc = std::int64_t (*)(const std::uint8_t* codes, const std::int16_t* weights, std::size_t dim);
+
+inline std::int64_t dotScalar(const std::uint8_t* codes, const std::int16_t* weights, std::size_t dim) {
+    std::int64_t result = 0;
+    for (std::size_t i = 0; i < dim; ++i)
+        result += static_cast<std::int64_t>(codes[i]) * weights[i];
+    return result;
+}
+
+#ifdef KNN_SIMD_X86
+
+// GCC 12 reports its own AVX-512 intrinsics as reading uninitialized values (GCC bug 105593).
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// The codes are widened to 16 bits and multiplied-added in pairs into 32-bit lanes, which the
+// weight bound of `Sq` keeps from overflowing.
+KNN_TARGET("sse4.1")
+inline std::int64_t dotSSE(const std::uint8_t* codes, const std::int16_t* weights, std::size_t dim) {
+    __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+    for (std::size_t i = 0; i < dim; i += 16) {
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes + i));
+        const __m128i w0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + i));
+        const __m128i w1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + i + 8));
+        acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_cvtepu8_epi16(c), w0));
+        acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(c, 8)), w1));
+    }
+    const __m128i acc = _mm_add_epi32(acc0, acc1);
+    return simd::hsum64(_mm_add_epi64(_mm_cvtepi32_epi64(acc), _mm_cvtepi32_epi64(_mm_srli_si128(acc, 8))));
+}
+
+KNN_TARGET("avx2,fma")
+inline std::int64_t dotAVX2(const std::uint8_t* codes, const std::int16_t* weights, std::size_t dim) {
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    for (std::size_t i = 0; i < dim; i += 32) {
+        const __m128i c0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes + i));
+        const __m128i c1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes + i + 16));
+        const __m256i w0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights + i));
+        const __m256i w1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(weights + i + 16));
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_cvtepu8_epi16(c0), w0));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_cvtepu8_epi16(c1), w1));
+    }
+    const __m256i acc = _mm256_add_epi32(acc0, acc1);
+    return simd::hsum64(_mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(acc)), _mm256_cvtepi32_epi64(_mm256_extracti128_si256(acc, 1))));
+}
+
+KNN_TARGET("avx512f,avx512bw")
+inline std::int64_t dotAVX512(const std::uint8_t* codes, const std::int16_t* weights, std::size_t dim) {
+    __m512i acc0 = _mm512_setzero_si512(), acc1 = _mm512_setzero_si512();
+    for (std::size_t i = 0; i < dim; i += 64) {
+        const __m512i c0 = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(codes + i)));
+        const __m512i c1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(codes + i + 32)));
+        acc0 = _mm512_add_epi32(acc0, _mm512_madd_epi16(c0, _mm512_loadu_si512(weights + i)));
+        acc1 = _mm512_add_epi32(acc1, _mm512_madd_epi16(c1, _mm512_loadu_si512(weights + i + 32)));
+    }
+    const __m512i acc = _mm512_add_epi32(acc0, acc1);
+    return _mm512_reduce_add_epi64(_mm512_add_epi64(_mm512_cvtepi32_epi64(_mm512_castsi512_si256(acc)),
+                                                    _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(acc, 1))));
+}
+
+KNN_TARGET("avx512f,avx512bw,avx512vnni")
+inline std::int64_t dotVNNI(const std::uint8_t* codes, const std::int16_t* weights, std::size_t dim) {
+    __m512i acc0 = _mm512_setzero_si512(), acc1 = _mm512_setzero_si512();
+    for (std::size_t i = 0; i < dim; i += 64) {
+        const __m512i c0 = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(codes + i)));
+        const __m512i c1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(codes + i + 32)));
+        acc0 = _mm512_dpwssd_epi32(acc0, c0, _mm512_loadu_si512(weights + i));
+        acc1 = _mm512_dpwssd_epi32(acc1, c1, _mm512_loadu_si512(weights + i + 32));
+    }
+    const __m512i acc = _mm512_add_epi32(acc0, acc1);
+    return _mm512_reduce_add_epi64(_mm512_add_epi64(_mm512_cvtepi32_epi64(_mm512_castsi512_si256(acc)),
+                                                    _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(acc, 1))));
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif // KNN_SIMD_X86
+
+/**
+ * Fastest kernel at the active level of <KnnSimd.h>.
+ */
+inline DotFunc select() {
+#ifdef KNN_SIMD_X86
+    const simd::CpuFeatures& cpu = simd::cpu();
+    switch (simd::activeLevel()) {
+    case simd::Level::AVX512:
+        if (cpu.avx512bw)
+            return cpu.avx512vnni ? &dotVNNI : &dotAVX512;
+        return &dotAVX2;
+    case simd::Level::AVX2:
+        return &dotAVX2;
+    case simd::Level::SSE:
+        return &dotSSE;
+    default:
+        break;
+    }
+#endif
+    return &dotScalar;
+}
+} // namespace sq
+
+////////////////////////////////////////////////////////////////
+// SQ index.
+template <typename data_type>
+class Sq : public Index<data_type> {
+    using stdVectorCode = std::vector<std::uint8_t, AlignedAllocator<std::uint8_t>>;
+    using stdVectorWeight = std::vector<std::int16_t, AlignedAllocator<std::int16_t>>;
+
+    static constexpr unsigned int LEVELS = 255; /* Largest code. */
+    static constexpr unsigned int PADDING = 64; /* Codes per row are padded to a multiple of it, so the kernels have no tail. */
+
+public:
+    explicit Sq(const SqParams& params = SqParams()) : m_params(params) {}
+
+    /**
+	 * Learned the range of every dimension, then encoded every row.
+	 */
+    void build(const DataSet<data_type>& data) override {
+        m_data = &data;
+        m_dim = data.dim();
+        m_size = data.size();
+        m_stride = (m_dim + PADDING - 1) / PADDING * PADDING;
+
+        m_min.assign(m_dim, std::numeric_limits<double>::infinity());
+        std::vector<double> max(m_dim, -std::numeric_limits<double>::infinity());
+        for (unsigned int i = 0; i < m_size; ++i) {
+            const data_type* row = data.row(i);
+            for (unsigned int d = 0; d < m_dim; ++d) {
+                m_min[d] = std::min(m_min[d], static_cast<double>(row[d]));
+                max[d] = std::max(max[d], static_cast<double>(row[d]));
+            }
+        }
+        m_step.resize(m_dim);
+        for (unsigned int d = 0; d < m_dim; ++d)
+            m_step[d] = m_size ? (max[d] - m_min[d]) / LEVELS : 0.0;
+
+        m_codes.assign(static_cast<std::size_t>(m_size) * m_stride, 0);
+        m_norms.resize(m_size);
+        for (unsigned int i = 0; i < m_size; ++i) {
+            const data_type* row = data.row(i);
+            std::uint8_t* code = m_codes.data() + static_cast<std::size_t>(i) * m_stride;
+            double norm = 0;
+            for (unsigned int d = 0; d < m_dim; ++d) {
+                const double level = m_step[d] > 0 ? std::round((static_cast<double>(row[d]) - m_min[d]) / m_step[d]) : 0.0;
+                code[d] = static_cast<std::uint8_t>(std::min<double>(LEVELS, std::max(0.0, level)));
+                norm += (m_step[d] * code[d]) * (m_step[d] * code[d]);
+            }
+            m_norms[i] = norm;
+        }
+
+        m_maxWeight = weightBound(m_stride);
+    }
+
+    /**
+	 * Scanned the codes with the quantized query weights, then re-ranked the `rerank` best
+	 * candidates with exact distances if asked to. Without re-ranking the distances are the
+	 * (approximate) quantized ones.
+	 */
+    unsigned int search(const data_type* test, unsigned int K, Neighbor* out) const override {
+        if (m_size == 0)
+            return 0;
+
+        // weight s(q - m) of every dimension, scaled to the 16-bit integers of `weights`.
+        std::vector<double> exact(m_dim);
+        double base = 0, largest = 0;
+        for (unsigned int d = 0; d < m_dim; ++d) {
+            const double offset = static_cast<double>(test[d]) - m_min[d];
+            base += offset * offset;
+            exact[d] = m_step[d] * offset;
+            largest = std::max(largest, std::fabs(exact[d]));
+        }
+        const double scale = largest > 0 ? largest / m_maxWeight : 1.0;
+        stdVectorWeight weights(m_stride, 0);
+        for (unsigned int d = 0; d < m_dim; ++d)
+            weights[d] = static_cast<std::int16_t>(std::lround(exact[d] / scale));
+
+        const sq::DotFunc dot = sq::select();
+        const unsigned int candidates = m_params.rerank ? std::max(K, m_params.rerank) : K;
+        return withTopK(candidates, [&](auto top) {
+            for (unsigned int i = 0; i < m_size; ++i) {
+                const double products = static_cast<double>(dot(m_codes.data() + static_cast<std::size_t>(i) * m_stride, weights.data(), m_stride));
+                const double distance = base - 2 * scale * products + m_norms[i];
+                top.push(distance > 0 ? distance : 0, i);
+            }
+            if (!m_params.rerank)
+                return top.copyTo(out);
+
+            const auto squaredL2 = simd::squaredL2<data_type>();
+            return withTopK(K, [&](auto reranked) {
+                for (unsigned int i = 0; i < top.size(); ++i)
+                    reranked.push(squaredL2(m_data->row(top.data()[i].index), test, m_dim), top.data()[i].index);
+                return reranked.copyTo(out);
+            });
+        });
+    }
+
+    /**
+	 * The raw training set is only read back to re-rank.
+	 */
+    bool needsData() const override {
+        return m_params.rerank > 0;
+    }
+
+    void save(ArchiveWriter& out) const override {
+        out.tag("Sq");
+        out.value(m_params);
+        out.value(m_dim);
+        out.value(m_size);
+        out.value(m_stride);
+        out.value(m_maxWeight);
+        out.vector(m_min);
+        out.vector(m_step);
+        out.vector(m_codes);
+        out.vector(m_norms);
+    }
+
+    bool load(ArchiveReader& in, const DataSet<data_type>& data) override {
+        m_data = &data;
+        return in.tag("Sq") && in.value(m_params) && in.value(m_dim) && in.value(m_size) && in.value(m_stride) && in.value(m_maxWeight) &&
+               in.vector(m_min) && in.vector(m_step) && in.vector(m_codes) && in.vector(m_norms) && m_dim == data.dim() &&
+               m_stride == (m_dim + PADDING - 1) / PADDING * PADDING && m_maxWeight == weightBound(m_stride) &&
+               m_min.size() == m_dim && m_step.size() == m_dim && m_codes.size() == static_cast<std::size_t>(m_size) * m_stride &&
+               m_norms.size() == m_size && (!needsData() || m_size <= data.size());
+    }
+
+private:
+    /**
+	 * |weight| bound: a 32-bit lane adds up to stride / 4 products of a code and a weight (SSE4.1).
+	 */
+    static double weightBound(unsigned int stride) {
+        const double products = std::max(1.0, stride / 4.0);
+        return std::min(32767.0, std::floor(std::numeric_limits<std::int32_t>::max() / (LEVELS * products)));
+    }
+
+    SqParams m_params;
+    const DataSet<data_type>* m_data = nullptr;
+    unsigned int m_dim = 0;
+    unsigned int m_size = 0;
+    unsigned int m_stride = 0;    /* Bytes per code, padded. */
+    double m_maxWeight = 32767.0; /* Largest |weight| the kernels add up without overflow. */
+    std::vector<double> m_min;    /* Per dimension. */
+    std::vector<double> m_step;   /* Per dimension, (max - min) / 255. */
+    stdVectorCode m_codes;        /* `stride` codes per row. */
+    std::vector<double> m_norms;  /* ||s·c||² of every row. */
+};
+} // namespace KNN
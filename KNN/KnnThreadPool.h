@@ -0,0 +1,202 @@
+//
+// KnnThreadPool.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnThreadPool.h> header.
+// A small fixed-size thread pool used by <Knn.h> to split one scan over several cores,
+// and the lock its queries share with the changes of the training set.
+//
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+////////////////////////////////////////////////////////////////
+// Fixed-size thread pool.
+// `run` may be called from any number of threads at once; the calling thread always
+// takes part in its own tasks, so a saturated pool degrades to a serial loop instead of stalling.
+class ThreadPool {
+public:
+    /**
+	 * Constructor, `threads` counts the caller: `threads - 1` workers are started.
+	 */
+    explicit ThreadPool(unsigned int threads) {
+        for (unsigned int i = 1; i < threads; ++i)
+            m_workers.emplace_back([this] { work(); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (std::thread& worker : m_workers)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;            /* Deleted the copy constructor. */
+    ThreadPool& operator=(const ThreadPool&) = delete; /* Deleted the copy assignment operator. */
+
+    /**
+	 * Threads taking part in a `run`, the caller included.
+	 */
+    unsigned int size() const { return static_cast<unsigned int>(m_workers.size()) + 1; }
+
+    /**
+	 * Called `task(i)` for every `i` in [0, `tasks`) and returned once all calls are done.
+	 */
+    template <typename function>
+    void run(unsigned int tasks, function&& task) {
+        if (tasks == 0)
+            return;
+
+        // Shared with the helpers: one of them may only get scheduled after `run` returned.
+        auto batch = std::make_shared<Batch>();
+        batch->tasks = tasks;
+        std::function<void(unsigned int)> call = [&task](unsigned int i) { task(i); };
+        batch->call = &call;
+
+        const unsigned int helpers = std::min<unsigned int>(tasks - 1, static_cast<unsigned int>(m_workers.size()));
+        if (helpers) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                for (unsigned int i = 0; i < helpers; ++i)
+                    m_queue.push_back(batch);
+            }
+            if (helpers == 1)
+                m_wake.notify_one();
+            else
+                m_wake.notify_all();
+        }
+
+        batch->drain();
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->finished.wait(lock, [&] { return batch->done == batch->tasks; });
+    }
+
+private:
+    struct Batch {
+        std::atomic<unsigned int> next{0};
+        unsigned int tasks = 0;
+        unsigned int done = 0;
+        const std::function<void(unsigned int)>* call = nullptr;
+        std::mutex mutex;
+        std::condition_variable finished;
+
+        /**
+		 * Claimed and ran tasks until none is left. `call` is only touched after a successful
+		 * claim, while the owner of the batch is still waiting for it.
+		 */
+        void drain() {
+            unsigned int ran = 0;
+            for (unsigned int i; (i = next.fetch_add(1)) < tasks; ++ran)
+                (*call)(i);
+            if (ran) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done += ran;
+                if (done == tasks)
+                    finished.notify_all();
+            }
+        }
+    };
+
+    void work() {
+        for (;;) {
+            std::shared_ptr<Batch> batch;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+                if (m_stop)
+                    return;
+                batch = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+            batch->drain();
+        }
+    }
+
+    std::vector<std::thread> m_workers;
+    std::deque<std::shared_ptr<Batch>> m_queue;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_stop = false;
+};
+
+////////////////////////////////////////////////////////////////
+// Reader-writer lock for data that many threads read and few change.
+// A reader only counts itself on the slot (a cache line) of its thread, so concurrent readers
+// write no shared memory; a writer raises a flag that turns new readers away, and sleeps until
+// the last reader leaving its slot wakes it. The readers turned away block on the mutex the
+// writer holds, so writers are not starved and nobody spins.
+// Meets SharedMutex: use it with `std::shared_lock`, `std::unique_lock` and
+// `std::condition_variable_any`. Not recursive, neither shared nor exclusive.
+class ReadMostlyMutex {
+public:
+    void lock_shared() {
+        for (;;) {
+            slot().fetch_add(1, std::memory_order_seq_cst);
+            if (!m_writing.load(std::memory_order_seq_cst))
+                return;
+            unlock_shared();
+            std::lock_guard<std::mutex> wait(m_writer); // until the writer that raised the flag is done.
+        }
+    }
+
+    void unlock_shared() {
+        slot().fetch_sub(1, std::memory_order_seq_cst);
+        if (m_writing.load(std::memory_order_seq_cst)) {
+            { std::lock_guard<std::mutex> lock(m_drain); } // the writer is either waiting, or has yet to count the slots.
+            m_drained.notify_one();
+        }
+    }
+
+    void lock() {
+        m_writer.lock();
+        m_writing.store(true, std::memory_order_seq_cst);
+        std::unique_lock<std::mutex> lock(m_drain);
+        m_drained.wait(lock, [this]() {
+            return std::all_of(std::begin(m_slots), std::end(m_slots),
+                               [](const Slot& slot) { return slot.readers.load(std::memory_order_seq_cst) == 0; });
+        });
+    }
+
+    void unlock() {
+        m_writing.store(false, std::memory_order_release);
+        m_writer.unlock();
+    }
+
+private:
+    static constexpr unsigned int SLOTS = 32; /* Threads beyond share slots, which only costs them contention. */
+
+    struct alignas(64) Slot {
+        std::atomic<unsigned int> readers{0};
+    };
+
+    std::atomic<unsigned int>& slot() {
+        static std::atomic<unsigned int> threads{0};
+        thread_local const unsigned int index = threads.fetch_add(1, std::memory_order_relaxed) % SLOTS;
+        return m_slots[index].readers;
+    }
+
+    Slot m_slots[SLOTS];
+    std::atomic<bool> m_writing{false}; /* Set by the writer holding `m_writer`, while it waits or writes. */
+    std::mutex m_writer;
+    std::mutex m_drain; /* Orders the writer counting the slots with the readers leaving them. */
+    std::condition_variable m_drained;
+};
+} // namespace KNN
@@ -0,0 +1,254 @@
+//
+// KnnVpTree.h
+//
+//      Author: Jachin Fang.
+//
+// The Pattern Recognition Library <KnnVpTree.h> header.
+// Vantage-point tree index for <Knn.h>: exact K-nearest queries in any metric space (see <KnnMetric.h>),
+// e.g. edit distance, where coordinates and hyperplanes mean nothing. Every node splits its rows into the
+// half nearer to a vantage row and the half farther from it, and a query skips a half whenever the triangle
+// inequality shows it cannot hold a better candidate.
+//
+// Yianilos P N. Data structures and algorithms for nearest neighbor search in general metric spaces[C]. SODA, 1993.
+//
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "KnnBase.h"
+#include "KnnMetric.h"
+
+////////////////////////////////////////////////////////////////
+// The namespace `KNN`
+// In general, it should not be used or modified externally.
+namespace KNN {
+
+template <typename data_type, typename metric>
+class VpTree;
+
+////////////////////////////////////////////////////////////////
+// Parameters of the VP-tree index, over the metric `metric`.
+template <typename metric = Euclidean>
+struct VpTreeParams {
+    unsigned int leafSize = 16; /* Maximum rows per leaf. */
+    unsigned int seed = 100;    /* Seed of the vantage point sampling. */
+    metric distance = metric(); /* The metric, for the metrics with a state. */
+
+    template <typename data_type>
+    using index = VpTree<data_type, metric>;
+};
+
+////////////////////////////////////////////////////////////////
+// VP-tree index. The distances it reports are those of `metric`.
+template <typename data_type, typename metric = Euclidean>
+class VpTree : public Index<data_type> {
+    static constexpr std::uint32_t NONE = 0xffffffffu;
+
+    /* The metric with its kernel selected, bound once per build or query. */
+    using Distance = decltype(bindMetric<data_type>(std::declval<const metric&>()));
+
+    ////////////////////////////////////////////////////////////////
+    // Inner node: vantage row `row`; the rows of `inside` lie at [innerLow, innerHigh] from it and
+    // those of `outside` at [outerLow, outerHigh]. Leaf: `row` is `NONE`, and its rows are
+    // `m_order[inside, outside)`.
+    struct Node {
+        std::uint32_t row;
+        std::uint32_t inside;
+        std::uint32_t outside;
+        double innerLow, innerHigh;
+        double outerLow, outerHigh;
+    };
+
+public:
+    explicit VpTree(const VpTreeParams<metric>& params = VpTreeParams<metric>()) : m_params(params) {
+        m_params.leafSize = std::max(1u, m_params.leafSize);
+    }
+
+    /**
+	 * Picked as vantage row of every node the sampled row whose distances spread the most,
+	 * and split the other rows at their median distance to it.
+	 */
+    void build(const DataSet<data_type>& data) override {
+        m_data = &data;
+        m_dim = data.dim();
+        m_nodes.clear();
+        m_order.resize(data.size());
+        std::iota(m_order.begin(), m_order.end(), 0u);
+        m_distances.resize(data.size());
+        std::mt19937 random(m_params.seed);
+        const Distance distance = bindMetric<data_type>(m_params.distance);
+        m_root = data.size() ? buildNode(0, data.size(), distance, random) : NONE;
+        std::vector<double>().swap(m_distances);
+    }
+
+    double distance(const data_type* a, const data_type* b, unsigned int dim) const override {
+        return m_params.distance(a, b, dim);
+    }
+
+    unsigned int search(const data_type* test, unsigned int K, Neighbor* out) const override {
+        if (m_root == NONE)
+            return 0;
+        const Distance distance = bindMetric<data_type>(m_params.distance);
+        return withTopK(K, [&](auto top) {
+            searchNode(test, top, distance, m_root);
+            return top.copyTo(out);
+        });
+    }
+
+    /**
+	 * The metric is saved with the tree only if it is trivially copyable; otherwise the one of the
+	 * parameters this index was made with is kept.
+	 */
+    void save(ArchiveWriter& out) const override {
+        out.tag("VpTree");
+        out.value(m_params.leafSize);
+        out.value(m_params.seed);
+        if constexpr (std::is_trivially_copyable<metric>::value)
+            out.value(m_params.distance);
+        out.value(m_dim);
+        out.value(m_root);
+        out.vector(m_nodes);
+        out.vector(m_order);
+    }
+
+    bool load(ArchiveReader& in, const DataSet<data_type>& data) override {
+        if (!(in.tag("VpTree") && in.value(m_params.leafSize) && in.value(m_params.seed)))
+            return false;
+        if constexpr (std::is_trivially_copyable<metric>::value)
+            if (!in.value(m_params.distance))
+                return false;
+        m_data = &data;
+        return in.value(m_dim) && in.value(m_root) && in.vector(m_nodes) && in.vector(m_order) && m_dim == data.dim() &&
+               m_order.size() <= data.size() && (m_root == NONE || m_root < m_nodes.size()) && consistent(data);
+    }
+
+private:
+    /**
+	 * Whether every row and child of a loaded tree is in range; children come after their parent,
+	 * as `buildNode` numbers them, so that a query cannot loop.
+	 */
+    bool consistent(const DataSet<data_type>& data) const {
+        for (std::uint32_t row : m_order)
+            if (row >= data.size())
+                return false;
+        const std::size_t count = m_nodes.size();
+        for (std::size_t node = 0; node < count; ++node) {
+            const Node& current = m_nodes[node];
+            if (current.row == NONE) {
+                if (current.inside > current.outside || current.outside > m_order.size())
+                    return false;
+            } else if (current.row >= data.size() || current.outside <= node || current.outside >= count ||
+                       (current.inside != NONE && (current.inside <= node || current.inside >= count))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::uint32_t buildNode(std::uint32_t first, std::uint32_t last, const Distance& distance, std::mt19937& random) {
+        const std::uint32_t node = static_cast<std::uint32_t>(m_nodes.size());
+        m_nodes.push_back(Node{NONE, first, last, 0, 0, 0, 0});
+        if (last - first <= m_params.leafSize)
+            return node;
+
+        std::swap(m_order[first], m_order[first + selectVantage(first, last, distance, random)]);
+        const data_type* vantage = m_data->row(m_order[first]);
+        for (std::uint32_t i = first + 1; i < last; ++i)
+            m_distances[m_order[i]] = distance(vantage, m_data->row(m_order[i]), m_dim);
+
+        // inside: [first + 1, middle), outside: [middle, last).
+        const std::uint32_t middle = first + 1 + (last - first - 1) / 2;
+        auto nearer = [&](std::uint32_t a, std::uint32_t b) { return m_distances[a] < m_distances[b]; };
+        std::nth_element(m_order.begin() + first + 1, m_order.begin() + middle, m_order.begin() + last, nearer);
+        auto inner = std::minmax_element(m_order.begin() + first + 1, m_order.begin() + middle, nearer);
+        auto outer = std::minmax_element(m_order.begin() + middle, m_order.begin() + last, nearer);
+
+        Node split{m_order[first], NONE, NONE, 0, 0, 0, 0};
+        if (first + 1 < middle) {
+            split.innerLow = m_distances[*inner.first];
+            split.innerHigh = m_distances[*inner.second];
+        }
+        split.outerLow = m_distances[*outer.first];
+        split.outerHigh = m_distances[*outer.second];
+        if (first + 1 < middle)
+            split.inside = buildNode(first + 1, middle, distance, random);
+        split.outside = buildNode(middle, last, distance, random);
+        m_nodes[node] = split;
+        return node;
+    }
+
+    /**
+	 * Offset in [first, last) of the candidate vantage row whose distances to a sample of the rows
+	 * have the largest variance: such a row splits its node into well-separated halves.
+	 */
+    std::uint32_t selectVantage(std::uint32_t first, std::uint32_t last, const Distance& distance, std::mt19937& random) const {
+        const unsigned int CANDIDATES = 5, SAMPLES = 16;
+        std::uniform_int_distribution<std::uint32_t> pick(0, last - first - 1);
+        std::uint32_t best = 0;
+        double bestSpread = -1;
+        for (unsigned int c = 0; c < CANDIDATES; ++c) {
+            const std::uint32_t candidate = pick(random);
+            const data_type* row = m_data->row(m_order[first + candidate]);
+            double sum = 0, squares = 0;
+            for (unsigned int s = 0; s < SAMPLES; ++s) {
+                const double d = distance(row, m_data->row(m_order[first + pick(random)]), m_dim);
+                sum += d;
+                squares += d * d;
+            }
+            const double spread = squares / SAMPLES - (sum / SAMPLES) * (sum / SAMPLES);
+            if (spread > bestSpread) {
+                bestSpread = spread;
+                best = candidate;
+            }
+        }
+        return best;
+    }
+
+    /**
+	 * Visited the half the query falls into first; a half whose rows all lie farther than
+	 * the current K-th candidate (by the triangle inequality) is skipped.
+	 */
+    template <typename selector>
+    void searchNode(const data_type* test, selector& top, const Distance& distance, std::uint32_t node) const {
+        const Node& current = m_nodes[node];
+        if (current.row == NONE) {
+            for (std::uint32_t i = current.inside; i < current.outside; ++i)
+                top.push(distance(m_data->row(m_order[i]), test, m_dim), m_order[i]);
+            return;
+        }
+
+        const double d = distance(m_data->row(current.row), test, m_dim);
+        top.push(d, current.row);
+        auto visitInside = [&] {
+            if (current.inside != NONE && d + top.threshold() >= current.innerLow && d - top.threshold() <= current.innerHigh)
+                searchNode(test, top, distance, current.inside);
+        };
+        auto visitOutside = [&] {
+            if (d + top.threshold() >= current.outerLow && d - top.threshold() <= current.outerHigh)
+                searchNode(test, top, distance, current.outside);
+        };
+        if (d < current.outerLow) {
+            visitInside();
+            visitOutside();
+        } else {
+            visitOutside();
+            visitInside();
+        }
+    }
+
+    VpTreeParams<metric> m_params;
+    const DataSet<data_type>* m_data = nullptr;
+    unsigned int m_dim = 0;
+    std::uint32_t m_root = NONE;
+    std::vector<Node> m_nodes;
+    std::vector<std::uint32_t> m_order; /* Training row of every tree-ordered row. */
+    std::vector<double> m_distances;    /* Per row, distance to the vantage row being split on (build only). */
+};
+} // namespace KNN